@@ -18,11 +18,29 @@ struct Aabb {
     Aabb(const Vec3 &min, const Vec3 &max)
         : min_bounds(min), max_bounds(max) {}
 
+    // Box with inverted bounds, enclosing anything with it yields the
+    // other. No ray intersects it.
+    static inline Aabb empty();
+
     static inline Aabb enclose(const Aabb &box0, const Aabb &box1);
+    static inline Aabb enclose(const Aabb &box, const Vec3 &point);
+
+    inline Vec3 center() const;
+    inline Vec3 extent() const;
+    inline float surface_area() const;
 
     inline bool intersect(const Ray &ray, float tmin, float tmax) const;
+
+    // Same as intersect but with the reciprocal of the ray direction
+    // already computed, for testing one ray against many boxes.
+    inline bool intersect(const Ray &ray, const Vec3 &inv_dir,
+                          float tmin, float tmax) const;
 };
 
+inline Aabb Aabb::empty() {
+    return Aabb(Vec3::one * Infinity, Vec3::one * -Infinity);
+}
+
 inline Aabb Aabb::enclose(const Aabb &box0, const Aabb &box1) {
     Vec3 min_bounds(fminf(box0.min_bounds.x, box1.min_bounds.x),
                     fminf(box0.min_bounds.y, box1.min_bounds.y),
@@ -35,6 +53,27 @@ inline Aabb Aabb::enclose(const Aabb &box0, const Aabb &box1) {
     return Aabb(min_bounds, max_bounds);
 }
 
+inline Aabb Aabb::enclose(const Aabb &box, const Vec3 &point) {
+    return enclose(box, Aabb(point, point));
+}
+
+inline Vec3 Aabb::center() const {
+    return (min_bounds + max_bounds) * 0.5f;
+}
+
+inline Vec3 Aabb::extent() const {
+    return max_bounds - min_bounds;
+}
+
+inline float Aabb::surface_area() const {
+    Vec3 d = extent();
+    if (d.x < 0 || d.y < 0 || d.z < 0) {
+        // Empty box
+        return 0;
+    }
+    return 2.0f * (d.x*d.y + d.y*d.z + d.z*d.x);
+}
+
 inline bool Aabb::intersect(const Ray &ray, float tmin, float tmax) const {
     for (int a = 0; a < 3; ++a) {
         float inv_d = 1.0f / ray.direction[a];
@@ -52,6 +91,21 @@ inline bool Aabb::intersect(const Ray &ray, float tmin, float tmax) const {
     return true;
 }
 
+inline bool Aabb::intersect(const Ray &ray, const Vec3 &inv_dir,
+                            float tmin, float tmax) const
+{
+    for (int a = 0; a < 3; ++a) {
+        // The near plane is picked by the sign of the direction rather
+        // than by comparing distances, so inverted bounds are never hit
+        bool neg = inv_dir[a] < 0;
+        float t0 = ((neg ? max_bounds[a] : min_bounds[a]) - ray.origin[a]) * inv_dir[a];
+        float t1 = ((neg ? min_bounds[a] : max_bounds[a]) - ray.origin[a]) * inv_dir[a];
+        tmin = fmaxf(t0, tmin);
+        tmax = fminf(t1, tmax);
+    }
+    return tmin < tmax;
+}
+
 } // ne
 
 #endif // NE_AABB_H
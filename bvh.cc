@@ -0,0 +1,2783 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+#include "bvh.h"
+#include "entity.h"
+#include "aabb.h"
+
+namespace ne {
+
+const int MaxSahBins = 64;
+
+// Leaf sizes have to fit in the 16 bit prim_count of the flat nodes
+const int MaxLeafSize = UINT16_MAX;
+
+struct SahBin {
+    Aabb box = Aabb::empty();
+    int count = 0;
+};
+
+struct SahSplit {
+    int axis = -1;
+    int bin = 0;
+    float cost = Infinity;
+
+    // Bounds of the children
+    Aabb left_box;
+    Aabb right_box;
+};
+
+// Split of the references at a plane, references straddling the plane
+// are clipped into both children.
+struct SpatialSplit {
+    int axis = -1;
+    float position = 0;
+    float cost = Infinity;
+};
+
+// Maps centroids to SAH bins along one axis
+struct SahBinning {
+    float origin;
+    float scale;
+    int bins;
+
+    SahBinning(const Aabb &centroid_bounds, int axis, int bins)
+        : origin(centroid_bounds.min_bounds[axis]),
+          scale(bins / (centroid_bounds.max_bounds[axis] - origin)),
+          bins(bins) {}
+
+    inline int index(float c) const {
+        int b = static_cast<int>((c - origin) * scale);
+        return std::min(std::max(b, 0), bins - 1);
+    }
+};
+
+// Bounds and centroid of an entity, computed once before the build
+struct BuildRef {
+    Aabb box;
+    Vec3 centroid;
+    uint32_t index;
+};
+
+// Finds the bin boundary with the lowest SAH cost on any axis. References
+// whose centroid falls into a bin <= split.bin go to the left child.
+static SahSplit find_sah_split(const BuildRef *refs, size_t count,
+                               const Aabb &bounds,
+                               const Aabb &centroid_bounds,
+                               const BVH_Options &options)
+{
+    SahSplit best;
+    int bins = std::min(std::max(options.bins, 2), MaxSahBins);
+    SahBin bin[3][MaxSahBins];
+    Aabb right_box[MaxSahBins];
+    float right_area[MaxSahBins];
+    int right_count[MaxSahBins];
+    float inv_area = 1.0f / bounds.surface_area();
+
+    bool split_axis[3];
+    SahBinning binning[3] = {
+        SahBinning(centroid_bounds, 0, bins),
+        SahBinning(centroid_bounds, 1, bins),
+        SahBinning(centroid_bounds, 2, bins),
+    };
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = centroid_bounds.max_bounds[axis]
+                     - centroid_bounds.min_bounds[axis];
+        // No split if all centroids are on the same plane
+        split_axis[axis] = extent > Epsilon;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!split_axis[axis]) continue;
+            int b = binning[axis].index(refs[i].centroid[axis]);
+            bin[axis][b].box = Aabb::enclose(bin[axis][b].box, refs[i].box);
+            bin[axis][b].count++;
+        }
+    }
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (!split_axis[axis]) continue;
+
+        // Sweep from the right to accumulate the right side of each plane
+        Aabb acc = Aabb::empty();
+        int bin_count = 0;
+        for (int b = bins - 1; b > 0; --b) {
+            acc = Aabb::enclose(acc, bin[axis][b].box);
+            bin_count += bin[axis][b].count;
+            right_box[b] = acc;
+            right_area[b] = acc.surface_area();
+            right_count[b] = bin_count;
+        }
+
+        acc = Aabb::empty();
+        bin_count = 0;
+        for (int b = 0; b < bins - 1; ++b) {
+            acc = Aabb::enclose(acc, bin[axis][b].box);
+            bin_count += bin[axis][b].count;
+            if (bin_count == 0 || right_count[b+1] == 0) {
+                continue;
+            }
+            float cost = options.traversal_cost
+                       + options.intersect_cost * inv_area
+                       * (acc.surface_area() * bin_count
+                          + right_area[b+1] * right_count[b+1]);
+            if (cost < best.cost) {
+                best.axis = axis;
+                best.bin = b;
+                best.cost = cost;
+                best.left_box = acc;
+                best.right_box = right_box[b+1];
+            }
+        }
+    }
+    return best;
+}
+
+inline bool is_empty(const Aabb &box) {
+    return box.min_bounds.x > box.max_bounds.x
+        || box.min_bounds.y > box.max_bounds.y
+        || box.min_bounds.z > box.max_bounds.z;
+}
+
+// Finds the spatial split with the lowest SAH cost. Bins are evenly
+// spaced in the node bounds, and each reference is chopped into every
+// bin it overlaps with Entity::split_box. It is counted as entering the
+// first bin and exiting the last.
+static SpatialSplit find_spatial_split(
+    const std::vector<BuildRef> &refs,
+    const std::vector<const Entity *> &prims,
+    const Aabb &bounds,
+    const BVH_Options &options)
+{
+    SpatialSplit best;
+    int bins = std::min(std::max(options.bins, 2), MaxSahBins);
+    SahBin bin[MaxSahBins];
+    int entry[MaxSahBins];
+    int exit[MaxSahBins];
+    float right_area[MaxSahBins];
+    int right_count[MaxSahBins];
+    float inv_area = 1.0f / bounds.surface_area();
+
+    for (int axis = 0; axis < 3; ++axis) {
+        float origin = bounds.min_bounds[axis];
+        float extent = bounds.max_bounds[axis] - origin;
+        if (extent <= Epsilon) {
+            continue;
+        }
+        float width = extent / bins;
+        std::fill(bin, bin + bins, SahBin());
+        std::fill(entry, entry + bins, 0);
+        std::fill(exit, exit + bins, 0);
+
+        for (const auto &ref : refs) {
+            int first = static_cast<int>(
+                (ref.box.min_bounds[axis] - origin) / width);
+            int last = static_cast<int>(
+                (ref.box.max_bounds[axis] - origin) / width);
+            first = std::min(std::max(first, 0), bins - 1);
+            last = std::min(std::max(last, first), bins - 1);
+
+            Aabb rest = ref.box;
+            for (int b = first; b < last; ++b) {
+                Aabb left;
+                Aabb right;
+                prims[ref.index]->split_box(rest, axis,
+                                            origin + (b + 1) * width,
+                                            left, right);
+                bin[b].box = Aabb::enclose(bin[b].box, left);
+                rest = right;
+            }
+            bin[last].box = Aabb::enclose(bin[last].box, rest);
+            entry[first]++;
+            exit[last]++;
+        }
+
+        Aabb acc = Aabb::empty();
+        int bin_count = 0;
+        for (int b = bins - 1; b > 0; --b) {
+            acc = Aabb::enclose(acc, bin[b].box);
+            bin_count += exit[b];
+            right_area[b] = acc.surface_area();
+            right_count[b] = bin_count;
+        }
+
+        acc = Aabb::empty();
+        bin_count = 0;
+        for (int b = 0; b < bins - 1; ++b) {
+            acc = Aabb::enclose(acc, bin[b].box);
+            bin_count += entry[b];
+            if (bin_count == 0 || right_count[b+1] == 0) {
+                continue;
+            }
+            float cost = options.traversal_cost
+                       + options.intersect_cost * inv_area
+                       * (acc.surface_area() * bin_count
+                          + right_area[b+1] * right_count[b+1]);
+            if (cost < best.cost) {
+                best.axis = axis;
+                best.position = origin + (b + 1) * width;
+                best.cost = cost;
+            }
+        }
+    }
+    return best;
+}
+
+// Node of the tree built by BVH_Builder. Leaves hold indices of the
+// primitives the tree was built over.
+struct BuildNode {
+    std::shared_ptr<BuildNode> left;
+    std::shared_ptr<BuildNode> right;
+    std::vector<uint32_t> prims;
+    Aabb aabb;
+
+    bool is_leaf() const { return left == nullptr; }
+
+    // Out of line, destroying a subtree is recursive and never inlined
+    ~BuildNode();
+};
+
+BuildNode::~BuildNode() {}
+
+// Builds a BuildNode tree from flat arrays of primitive bounds. Subtrees near
+// the root are built on separate threads until there is a task for every
+// thread in BVH_Options::threads.
+class BVH_Builder {
+public:
+    // Subtrees with fewer references are always built on the current thread
+    static const size_t MinTaskSize = 1024;
+
+    BVH_Builder(const std::vector<const Entity *> &prims,
+                const BVH_Options &options);
+
+    void build(BuildNode &root);
+
+private:
+    const std::vector<const Entity *> &prims;
+    std::vector<BuildRef> refs;
+    const BVH_Options &options;
+    int task_depth;
+
+    // BVH_Options::max_leaf_size clamped to [1, MaxLeafSize]
+    int max_leaf_size;
+
+    // Morton codes of refs, only used by BVH_Build::Morton
+    std::vector<uint64_t> codes;
+    int code_bits;
+
+    // Number of references spatial splits may still add
+    std::atomic<long> duplicates_left;
+    float root_area;
+
+    void build_sah(BuildNode &node, size_t start, size_t end, int depth);
+
+    void build_spatial(BuildNode &node,
+                       std::vector<BuildRef> &node_refs,
+                       int depth);
+
+    void sort_morton();
+    void build_morton(BuildNode &node,
+                      size_t start, size_t end,
+                      int bit, int depth);
+
+    void make_leaf(BuildNode &node,
+                   const BuildRef *first,
+                   const BuildRef *last);
+
+    template <typename BuildLeft, typename BuildRight>
+    void build_children(size_t span, int depth,
+                        BuildLeft build_left,
+                        BuildRight build_right);
+};
+
+BVH_Builder::BVH_Builder(const std::vector<const Entity *> &prims,
+                         const BVH_Options &options)
+    : prims(prims), options(options)
+{
+    refs.resize(prims.size());
+    for (size_t i = 0; i < prims.size(); ++i) {
+        BuildRef &ref = refs[i];
+        if (!prims[i]->bounding_box(ref.box)) {
+            printf("[error] BVH_Node without bounding box\n");
+        }
+        ref.centroid = ref.box.center();
+        ref.index = i;
+    }
+
+    max_leaf_size = std::min(std::max(options.max_leaf_size, 1), MaxLeafSize);
+
+    // Every level of tasks doubles the number of threads in use
+    task_depth = 0;
+    while ((1 << task_depth) < options.threads) {
+        ++task_depth;
+    }
+}
+
+void BVH_Builder::build(BuildNode &root) {
+    switch (options.build) {
+    case BVH_Build::SAH:
+        build_sah(root, 0, refs.size(), 0);
+        break;
+    case BVH_Build::Morton:
+        sort_morton();
+        build_morton(root, 0, refs.size(), code_bits - 1, 0);
+        break;
+    case BVH_Build::Spatial: {
+        Aabb bounds = Aabb::empty();
+        for (const auto &ref : refs) {
+            bounds = Aabb::enclose(bounds, ref.box);
+        }
+        root_area = bounds.surface_area();
+        duplicates_left = static_cast<long>(
+            options.max_duplication * refs.size());
+        build_spatial(root, refs, 0);
+        break;
+    }
+    }
+}
+
+void BVH_Builder::make_leaf(BuildNode &node,
+                            const BuildRef *first,
+                            const BuildRef *last)
+{
+    node.prims.reserve(last - first);
+    for (const BuildRef *ref = first; ref != last; ++ref) {
+        node.prims.push_back(ref->index);
+    }
+}
+
+// Builds the left subtree on a new thread if this level of the tree is
+// split into tasks, the right subtree is always built on this thread.
+template <typename BuildLeft, typename BuildRight>
+void BVH_Builder::build_children(size_t span, int depth,
+                                 BuildLeft build_left,
+                                 BuildRight build_right)
+{
+    if (depth < task_depth && span >= MinTaskSize) {
+        std::thread task(build_left);
+        build_right();
+        task.join();
+        return;
+    }
+    build_left();
+    build_right();
+}
+
+void BVH_Builder::build_sah(BuildNode &node,
+                             size_t start, size_t end,
+                             int depth)
+{
+    size_t span = end - start;
+    Aabb centroid_bounds = Aabb::empty();
+    node.aabb = Aabb::empty();
+
+    for (size_t i = start; i < end; ++i) {
+        node.aabb = Aabb::enclose(node.aabb, refs[i].box);
+        centroid_bounds = Aabb::enclose(centroid_bounds, refs[i].centroid);
+    }
+
+    SahSplit split = find_sah_split(&refs[start], span, node.aabb,
+                                    centroid_bounds, options);
+    float leaf_cost = options.intersect_cost * span;
+
+    if (span <= 1
+        || (int(span) <= max_leaf_size && leaf_cost <= split.cost))
+    {
+        make_leaf(node, &refs[start], &refs[end]);
+        return;
+    }
+
+    size_t mid = start + span / 2;
+    if (split.axis >= 0) {
+        int bins = std::min(std::max(options.bins, 2), MaxSahBins);
+        SahBinning binning(centroid_bounds, split.axis, bins);
+        auto it = std::partition(
+            refs.begin() + start,
+            refs.begin() + end,
+            [&](const BuildRef &ref) {
+                return binning.index(ref.centroid[split.axis]) <= split.bin;
+            });
+        mid = it - refs.begin();
+    }
+    if (mid == start || mid == end) {
+        // All centroids overlap and there is no meaningful split,
+        // the primitives are divided in half to keep the leaves small.
+        mid = start + span / 2;
+    }
+
+    node.left = std::make_shared<BuildNode>();
+    node.right = std::make_shared<BuildNode>();
+
+    build_children(
+        span, depth,
+        [&]() { build_sah(*node.left, start, mid, depth + 1); },
+        [&]() { build_sah(*node.right, mid, end, depth + 1); });
+}
+
+// Spreads the lower 10 bits of v so there are two zero bits between each
+inline uint64_t morton_expand_10(uint64_t v) {
+    v &= 0x3ff;
+    v = (v | v << 16) & 0x30000ff;
+    v = (v | v << 8) & 0x300f00f;
+    v = (v | v << 4) & 0x30c30c3;
+    v = (v | v << 2) & 0x9249249;
+    return v;
+}
+
+// Spreads the lower 21 bits of v so there are two zero bits between each
+inline uint64_t morton_expand_21(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+}
+
+// Sorts refs along a Z-order curve through the centroid bounds. Small
+// scenes use 30 bit codes (10 bits per axis) which sort in 4 radix
+// passes, larger ones 63 bit codes so nearby centroids keep distinct
+// codes.
+void BVH_Builder::sort_morton() {
+    const size_t LargeScene = 1 << 16;
+    code_bits = refs.size() > LargeScene ? 63 : 30;
+    int axis_bits = code_bits / 3;
+    float cells = float(1 << axis_bits);
+
+    Aabb centroid_bounds = Aabb::empty();
+    for (const auto &ref : refs) {
+        centroid_bounds = Aabb::enclose(centroid_bounds, ref.centroid);
+    }
+    Vec3 extent = centroid_bounds.extent();
+
+    struct MortonRef {
+        uint64_t code;
+        uint32_t ref;
+    };
+    std::vector<MortonRef> keys(refs.size());
+    for (size_t i = 0; i < refs.size(); ++i) {
+        uint64_t c[3];
+        for (int a = 0; a < 3; ++a) {
+            float offset = refs[i].centroid[a] - centroid_bounds.min_bounds[a];
+            float t = extent[a] > 0 ? offset / extent[a] : 0;
+            c[a] = static_cast<uint64_t>(clamp(t * cells, 0, cells - 1));
+        }
+        if (code_bits == 30) {
+            keys[i].code = morton_expand_10(c[0]) << 2
+                         | morton_expand_10(c[1]) << 1
+                         | morton_expand_10(c[2]);
+        } else {
+            keys[i].code = morton_expand_21(c[0]) << 2
+                         | morton_expand_21(c[1]) << 1
+                         | morton_expand_21(c[2]);
+        }
+        keys[i].ref = i;
+    }
+
+    // LSD radix sort, 8 bits per pass
+    const int RadixBits = 8;
+    const int Buckets = 1 << RadixBits;
+    std::vector<MortonRef> temp(keys.size());
+    for (int shift = 0; shift < code_bits; shift += RadixBits) {
+        size_t offsets[Buckets] = {};
+        for (const auto &key : keys) {
+            offsets[(key.code >> shift) & (Buckets - 1)]++;
+        }
+        size_t sum = 0;
+        for (int b = 0; b < Buckets; ++b) {
+            size_t count = offsets[b];
+            offsets[b] = sum;
+            sum += count;
+        }
+        for (const auto &key : keys) {
+            temp[offsets[(key.code >> shift) & (Buckets - 1)]++] = key;
+        }
+        keys.swap(temp);
+    }
+
+    std::vector<BuildRef> sorted(refs.size());
+    codes.resize(refs.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        sorted[i] = refs[keys[i].ref];
+        codes[i] = keys[i].code;
+    }
+    refs.swap(sorted);
+}
+
+// Splits sorted refs where the highest differing bit of their Morton
+// codes changes, this is a split at the center of the node's cell on
+// the axis of that bit.
+void BVH_Builder::build_morton(BuildNode &node,
+                               size_t start, size_t end,
+                               int bit, int depth)
+{
+    size_t span = end - start;
+    if (int(span) <= max_leaf_size) {
+        node.aabb = Aabb::empty();
+        for (size_t i = start; i < end; ++i) {
+            node.aabb = Aabb::enclose(node.aabb, refs[i].box);
+        }
+        make_leaf(node, &refs[start], &refs[end]);
+        return;
+    }
+
+    // Codes are sorted, so the first and last ref tell if any ref in
+    // between has the bit set
+    while (bit >= 0
+           && (codes[start] >> bit & 1) == (codes[end - 1] >> bit & 1))
+    {
+        --bit;
+    }
+
+    size_t mid = start + span / 2;
+    if (bit >= 0) {
+        auto it = std::partition_point(
+            codes.begin() + start,
+            codes.begin() + end,
+            [=](uint64_t code) { return (code >> bit & 1) == 0; });
+        mid = it - codes.begin();
+    }
+    // Otherwise all refs have the same code and are split in half
+
+    node.left = std::make_shared<BuildNode>();
+    node.right = std::make_shared<BuildNode>();
+
+    build_children(
+        span, depth,
+        [&]() { build_morton(*node.left, start, mid, bit - 1, depth + 1); },
+        [&]() { build_morton(*node.right, mid, end, bit - 1, depth + 1); });
+
+    node.aabb = Aabb::enclose(node.left->aabb, node.right->aabb);
+}
+
+// Spatial split BVH (Stich et al. 2009). Spatial splits are only searched
+// when the children of the best object split overlap by more than
+// BVH_Options::spatial_alpha of the root's surface area, and only while
+// the duplication budget lasts.
+void BVH_Builder::build_spatial(BuildNode &node,
+                                std::vector<BuildRef> &node_refs,
+                                int depth)
+{
+    size_t span = node_refs.size();
+    Aabb centroid_bounds = Aabb::empty();
+    node.aabb = Aabb::empty();
+
+    for (const auto &ref : node_refs) {
+        node.aabb = Aabb::enclose(node.aabb, ref.box);
+        centroid_bounds = Aabb::enclose(centroid_bounds, ref.centroid);
+    }
+
+    SahSplit object = find_sah_split(node_refs.data(), span, node.aabb,
+                                     centroid_bounds, options);
+
+    SpatialSplit spatial;
+    if (object.axis >= 0 && duplicates_left > 0) {
+        const Aabb &l = object.left_box;
+        const Aabb &r = object.right_box;
+        Aabb overlap(Vec3(fmaxf(l.min_bounds.x, r.min_bounds.x),
+                          fmaxf(l.min_bounds.y, r.min_bounds.y),
+                          fmaxf(l.min_bounds.z, r.min_bounds.z)),
+                     Vec3(fminf(l.max_bounds.x, r.max_bounds.x),
+                          fminf(l.max_bounds.y, r.max_bounds.y),
+                          fminf(l.max_bounds.z, r.max_bounds.z)));
+        if (overlap.surface_area() > options.spatial_alpha * root_area) {
+            spatial = find_spatial_split(node_refs, prims,
+                                         node.aabb, options);
+        }
+    } else if (object.axis < 0 && duplicates_left > 0 && span > 1) {
+        // Centroids overlap, a spatial split may still separate the refs
+        spatial = find_spatial_split(node_refs, prims,
+                                     node.aabb, options);
+    }
+
+    float leaf_cost = options.intersect_cost * span;
+    float split_cost = fminf(object.cost, spatial.cost);
+    if (span <= 1
+        || (int(span) <= max_leaf_size && leaf_cost <= split_cost))
+    {
+        make_leaf(node, node_refs.data(), node_refs.data() + span);
+        return;
+    }
+
+    std::vector<BuildRef> left_refs;
+    std::vector<BuildRef> right_refs;
+
+    if (spatial.axis >= 0 && spatial.cost < object.cost) {
+        int axis = spatial.axis;
+        float position = spatial.position;
+
+        for (const auto &ref : node_refs) {
+            if (ref.box.max_bounds[axis] <= position) {
+                left_refs.push_back(ref);
+                continue;
+            }
+            if (ref.box.min_bounds[axis] >= position) {
+                right_refs.push_back(ref);
+                continue;
+            }
+
+            // Reference straddles the plane, clip it into both sides
+            BuildRef left = ref;
+            BuildRef right = ref;
+            prims[ref.index]->split_box(ref.box, axis, position,
+                                        left.box, right.box);
+            left.centroid = left.box.center();
+            right.centroid = right.box.center();
+
+            if (is_empty(right.box)) {
+                left_refs.push_back(left);
+            } else if (is_empty(left.box)) {
+                right_refs.push_back(right);
+            } else if (duplicates_left.fetch_sub(1) > 0) {
+                left_refs.push_back(left);
+                right_refs.push_back(right);
+            } else if (ref.centroid[axis] < position) {
+                // Out of budget, keep the reference on one side
+                left_refs.push_back(ref);
+            } else {
+                right_refs.push_back(ref);
+            }
+        }
+    } else if (object.axis >= 0) {
+        int bins = std::min(std::max(options.bins, 2), MaxSahBins);
+        SahBinning binning(centroid_bounds, object.axis, bins);
+        for (const auto &ref : node_refs) {
+            if (binning.index(ref.centroid[object.axis]) <= object.bin) {
+                left_refs.push_back(ref);
+            } else {
+                right_refs.push_back(ref);
+            }
+        }
+    }
+
+    if (left_refs.empty() || right_refs.empty()) {
+        // No meaningful split, divide the references in half
+        left_refs.assign(node_refs.begin(), node_refs.begin() + span / 2);
+        right_refs.assign(node_refs.begin() + span / 2, node_refs.end());
+    }
+
+    // Release this node's references before building the subtrees
+    std::vector<BuildRef>().swap(node_refs);
+
+    node.left = std::make_shared<BuildNode>();
+    node.right = std::make_shared<BuildNode>();
+
+    build_children(
+        span, depth,
+        [&]() { build_spatial(*node.left, left_refs, depth + 1); },
+        [&]() { build_spatial(*node.right, right_refs, depth + 1); });
+}
+
+static void count_nodes(const BuildNode &node, BVH_Stats &stats) {
+    stats.nodes++;
+    if (node.is_leaf()) {
+        stats.leaves++;
+        return;
+    }
+    count_nodes(*node.left, stats);
+    count_nodes(*node.right, stats);
+}
+
+// Builds a tree over prims into root and fills in BVH_Options::stats
+static void build_tree(const std::vector<const Entity *> &prims,
+                       const BVH_Options &options,
+                       BuildNode &root)
+{
+    auto start_time = std::chrono::steady_clock::now();
+
+    BVH_Builder builder(prims, options);
+    builder.build(root);
+
+    if (options.stats) {
+        auto end_time = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::milli> elapsed =
+            end_time - start_time;
+
+        *options.stats = BVH_Stats();
+        options.stats->build_ms = elapsed.count();
+        count_nodes(root, *options.stats);
+    }
+}
+
+// Copies a built tree, leaves get the entities their indices refer to
+static void copy_tree(const BuildNode &from,
+                      const std::shared_ptr<Entity> *entities,
+                      BVH_Node &to)
+{
+    to.aabb = from.aabb;
+    if (from.is_leaf()) {
+        to.prims.reserve(from.prims.size());
+        for (uint32_t i : from.prims) {
+            to.prims.push_back(entities[i]);
+        }
+        return;
+    }
+    to.left = std::make_shared<BVH_Node>();
+    to.right = std::make_shared<BVH_Node>();
+    copy_tree(*from.left, entities, *to.left);
+    copy_tree(*from.right, entities, *to.right);
+}
+
+BVH_Node::BVH_Node(std::vector<std::shared_ptr<Entity>> &entities,
+                   size_t start, size_t end,
+                   const BVH_Options &options)
+{
+    std::vector<const Entity *> prims;
+    prims.reserve(end - start);
+    for (size_t i = start; i < end; ++i) {
+        prims.push_back(entities[i].get());
+    }
+    BuildNode root;
+    build_tree(prims, options, root);
+    copy_tree(root, entities.data() + start, *this);
+}
+
+bool BVH_Node::bounding_box(Aabb &box) const {
+    box = aabb;
+    return true;
+}
+
+bool BVH_Node::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
+    if (!aabb.intersect(ray, range.min, range.max)) {
+        return false;
+    }
+    if (is_leaf()) {
+        bool any_hit = false;
+        for (const auto &prim : prims) {
+            if (prim->ray_intersect(ray, range, hit)) {
+                range.max = hit.dist;
+                any_hit = true;
+            }
+        }
+        return any_hit;
+    }
+    bool hit_left = left->ray_intersect(ray, range, hit);
+    range.max = hit_left ? hit.dist : range.max;
+    bool hit_right = right->ray_intersect(ray, range, hit);
+
+    return hit_left || hit_right;
+}
+
+bool BVH_Node::occluded(const Ray &ray, Range range) const {
+    if (!aabb.intersect(ray, range.min, range.max)) {
+        return false;
+    }
+    if (is_leaf()) {
+        for (const auto &prim : prims) {
+            if (prim->occluded(ray, range)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return left->occluded(ray, range) || right->occluded(ray, range);
+}
+
+// Surface area weighted sum of node costs, see BVH_Node::sah_cost.
+static float sah_subtree_cost(const BVH_Node *node,
+                              const BVH_Options &options)
+{
+    float area = node->aabb.surface_area();
+    if (node->is_leaf()) {
+        return area * options.intersect_cost * node->prims.size();
+    }
+    return area * options.traversal_cost
+         + sah_subtree_cost(node->left.get(), options)
+         + sah_subtree_cost(node->right.get(), options);
+}
+
+float BVH_Node::sah_cost(const BVH_Options &options) const {
+    float area = aabb.surface_area();
+    if (area <= 0) {
+        return 0;
+    }
+    return sah_subtree_cost(this, options) / area;
+}
+
+void BVH_Node::refit() {
+    if (is_leaf()) {
+        aabb = Aabb::empty();
+        for (const auto &prim : prims) {
+            Aabb box;
+            if (prim->bounding_box(box)) {
+                aabb = Aabb::enclose(aabb, box);
+            }
+        }
+        return;
+    }
+    left->refit();
+    right->refit();
+    aabb = Aabb::enclose(left->aabb, right->aabb);
+}
+
+// Appends node and its subtree to nodes depth first and returns its
+// index. add_leaf appends the primitives of a leaf and returns the
+// offset of the first.
+template <typename Node, typename AddLeaf>
+static uint32_t flatten_tree(const Node &node, int node_depth,
+                             std::vector<BVH_LinearNode> &nodes, int &depth,
+                             const AddLeaf &add_leaf)
+{
+    uint32_t index = nodes.size();
+    nodes.push_back(BVH_LinearNode{node.aabb, 0, 0, 0, 0});
+    depth = std::max(depth, node_depth);
+
+    if (node.is_leaf()) {
+        nodes[index].offset = add_leaf(node);
+        nodes[index].prim_count = node.prims.size();
+        return index;
+    }
+
+    // Children are split on the axis their centers are furthest apart,
+    // traversal expects the first child on the lower side of it
+    Vec3 d = node.right->aabb.center() - node.left->aabb.center();
+    int axis = 0;
+    for (int a = 1; a < 3; ++a) {
+        if (fabsf(d[a]) > fabsf(d[axis])) axis = a;
+    }
+    nodes[index].axis = axis;
+
+    const Node *lower = node.left.get();
+    const Node *upper = node.right.get();
+    if (d[axis] < 0) {
+        std::swap(lower, upper);
+    }
+    flatten_tree(*lower, node_depth + 1, nodes, depth, add_leaf);
+    uint32_t second = flatten_tree(*upper, node_depth + 1, nodes, depth, add_leaf);
+    nodes[index].offset = second;
+    return index;
+}
+
+// Builds the nodes of a LinearBVH over prims for structures that store
+// the primitives themselves. order gets the index of the primitive in
+// every leaf slot, spatial splits may put a primitive in several leaves.
+static void build_linear(const std::vector<const Entity *> &prims,
+                         const BVH_Options &options,
+                         std::vector<BVH_LinearNode> &nodes,
+                         std::vector<uint32_t> &order,
+                         int &depth)
+{
+    BuildNode root;
+    build_tree(prims, options, root);
+    flatten_tree(root, 1, nodes, depth,
+        [&](const BuildNode &leaf) {
+            uint32_t offset = order.size();
+            order.insert(order.end(), leaf.prims.begin(), leaf.prims.end());
+            return offset;
+        });
+}
+
+LinearBVH::LinearBVH(const BVH_Node &root) : depth(0), built_cost(0) {
+    if (root.is_leaf() && root.prims.empty()) {
+        // Nothing to intersect
+        return;
+    }
+    flatten(root, 1);
+    built_cost = sah_cost();
+}
+
+uint32_t LinearBVH::flatten(const BVH_Node &node, int node_depth) {
+    return flatten_tree(node, node_depth, nodes, depth,
+        [&](const BVH_Node &leaf) {
+            uint32_t offset = prims.size();
+            prims.insert(prims.end(), leaf.prims.begin(), leaf.prims.end());
+            return offset;
+        });
+}
+
+float LinearBVH::sah_cost(const BVH_Options &options) const {
+    if (nodes.empty() || nodes[0].aabb.surface_area() <= 0) {
+        return 0;
+    }
+    float cost = 0;
+    for (const auto &node : nodes) {
+        float area = node.aabb.surface_area();
+        if (node.prim_count > 0) {
+            cost += area * options.intersect_cost * node.prim_count;
+        } else {
+            cost += area * options.traversal_cost;
+        }
+    }
+    return cost / nodes[0].aabb.surface_area();
+}
+
+void LinearBVH::refit() {
+    // Children are always stored after their parent, so walking the
+    // nodes backwards updates children before parents.
+    for (size_t i = nodes.size(); i-- > 0;) {
+        auto &node = nodes[i];
+        if (node.prim_count == 0) {
+            node.aabb = Aabb::enclose(nodes[i + 1].aabb,
+                                      nodes[node.offset].aabb);
+            continue;
+        }
+        node.aabb = Aabb::empty();
+        for (uint32_t p = 0; p < node.prim_count; ++p) {
+            Aabb box;
+            if (prims[node.offset + p]->bounding_box(box)) {
+                node.aabb = Aabb::enclose(node.aabb, box);
+            }
+        }
+    }
+}
+
+bool LinearBVH::bounding_box(Aabb &box) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    box = nodes[0].aabb;
+    return true;
+}
+
+// Walks the nodes of a LinearBVH hit by a ray, nearer child first.
+// leaf(node, range) intersects the entities of a leaf and may shrink
+// range.max, returning true ends the walk.
+template <typename LeafFn>
+static void traverse_linear(const std::vector<BVH_LinearNode> &nodes,
+                            int depth, const Ray &ray, Range range,
+                            LeafFn leaf)
+{
+    if (nodes.empty()) {
+        return;
+    }
+    Vec3 inv_dir(1.0f / ray.direction.x,
+                 1.0f / ray.direction.y,
+                 1.0f / ray.direction.z);
+    bool dir_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+
+    uint32_t local_stack[LinearBVH::StackSize];
+    std::vector<uint32_t> heap_stack;
+    uint32_t *stack = local_stack;
+    if (depth > LinearBVH::StackSize) {
+        heap_stack.resize(depth);
+        stack = heap_stack.data();
+    }
+
+    int sp = 0;
+    uint32_t index = 0;
+
+    for (;;) {
+        const auto &node = nodes[index];
+        if (node.aabb.intersect(ray, inv_dir, range.min, range.max)) {
+            if (node.prim_count > 0) {
+                if (leaf(node, range)) {
+                    return;
+                }
+            } else if (dir_neg[node.axis]) {
+                // Second child is nearer, visit it first
+                stack[sp++] = index + 1;
+                index = node.offset;
+                continue;
+            } else {
+                stack[sp++] = node.offset;
+                index = index + 1;
+                continue;
+            }
+        }
+        if (sp == 0) {
+            break;
+        }
+        index = stack[--sp];
+    }
+}
+
+#if defined(__SSE__)
+// Slab test of one box against the lanes of a packet
+inline int slab_test_packet(const Aabb &box,
+                            __m128 ox, __m128 oy, __m128 oz,
+                            __m128 ix, __m128 iy, __m128 iz,
+                            __m128 min_dist, __m128 max_dist)
+{
+    __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min_bounds.x), ox), ix);
+    __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max_bounds.x), ox), ix);
+    __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min_bounds.y), oy), iy);
+    __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max_bounds.y), oy), iy);
+    __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min_bounds.z), oz), iz);
+    __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max_bounds.z), oz), iz);
+
+    __m128 tmin = _mm_max_ps(
+        _mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+        _mm_max_ps(_mm_min_ps(t0z, t1z), min_dist));
+    __m128 tmax = _mm_min_ps(
+        _mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+        _mm_min_ps(_mm_max_ps(t0z, t1z), max_dist));
+    return _mm_movemask_ps(_mm_cmplt_ps(tmin, tmax));
+}
+#endif // __SSE__
+
+// Walks the nodes of a LinearBVH hit by any lane of a packet. Each node
+// is tested against every lane with SSE. leaf(node, lanes) intersects the
+// lanes hitting a leaf and returns the mask of lanes hit, shrinking their
+// ranges. Lanes whose directions point into different octants would
+// disagree on the near child, in that case nothing is traversed and false
+// is returned so the caller can trace the lanes on their own.
+template <typename LeafFn>
+static bool traverse_linear_packet(const std::vector<BVH_LinearNode> &nodes,
+                                   int depth, RayPacket &packet, int mask,
+                                   int &hit_mask, LeafFn leaf)
+{
+    hit_mask = 0;
+#if defined(__SSE__)
+    if (nodes.empty() || mask == 0) {
+        return true;
+    }
+
+    float origin[3][RayPacket::Size];
+    float inv_dir[3][RayPacket::Size];
+    int first = -1;
+    bool dir_neg[3] = {false, false, false};
+
+    for (int i = 0; i < RayPacket::Size; ++i) {
+        const Ray &ray = packet.rays[i];
+        for (int a = 0; a < 3; ++a) {
+            origin[a][i] = ray.origin[a];
+            inv_dir[a][i] = 1.0f / ray.direction[a];
+        }
+        if (!(mask & (1 << i))) {
+            continue;
+        }
+        if (first < 0) {
+            first = i;
+            for (int a = 0; a < 3; ++a) {
+                dir_neg[a] = inv_dir[a][i] < 0;
+            }
+        }
+        for (int a = 0; a < 3; ++a) {
+            if ((inv_dir[a][i] < 0) != dir_neg[a]) {
+                return false;
+            }
+        }
+    }
+
+    __m128 ox = _mm_loadu_ps(origin[0]);
+    __m128 oy = _mm_loadu_ps(origin[1]);
+    __m128 oz = _mm_loadu_ps(origin[2]);
+    __m128 ix = _mm_loadu_ps(inv_dir[0]);
+    __m128 iy = _mm_loadu_ps(inv_dir[1]);
+    __m128 iz = _mm_loadu_ps(inv_dir[2]);
+    __m128 min_dist = _mm_loadu_ps(packet.min_dist);
+    __m128 max_dist = _mm_loadu_ps(packet.max_dist);
+
+    uint32_t local_stack[LinearBVH::StackSize];
+    std::vector<uint32_t> heap_stack;
+    uint32_t *stack = local_stack;
+    if (depth > LinearBVH::StackSize) {
+        heap_stack.resize(depth);
+        stack = heap_stack.data();
+    }
+
+    int sp = 0;
+    uint32_t index = 0;
+
+    for (;;) {
+        const auto &node = nodes[index];
+        int lanes = mask & slab_test_packet(node.aabb, ox, oy, oz,
+                                            ix, iy, iz, min_dist, max_dist);
+        if (lanes) {
+            if (node.prim_count > 0) {
+                int leaf_mask = leaf(node, lanes);
+                if (leaf_mask) {
+                    hit_mask |= leaf_mask;
+                    max_dist = _mm_loadu_ps(packet.max_dist);
+                }
+            } else if (dir_neg[node.axis]) {
+                // Second child is nearer, visit it first
+                stack[sp++] = index + 1;
+                index = node.offset;
+                continue;
+            } else {
+                stack[sp++] = node.offset;
+                index = index + 1;
+                continue;
+            }
+        }
+        if (sp == 0) {
+            break;
+        }
+        index = stack[--sp];
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool LinearBVH::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
+    bool any_hit = false;
+    traverse_linear(nodes, depth, ray, range,
+        [&](const BVH_LinearNode &node, Range &range) {
+            for (uint32_t i = 0; i < node.prim_count; ++i) {
+                if (prims[node.offset + i]->ray_intersect(ray, range, hit)) {
+                    range.max = hit.dist;
+                    any_hit = true;
+                }
+            }
+            return false;
+        });
+    return any_hit;
+}
+
+bool LinearBVH::occluded(const Ray &ray, Range range) const {
+    bool any_hit = false;
+    traverse_linear(nodes, depth, ray, range,
+        [&](const BVH_LinearNode &node, Range &range) {
+            for (uint32_t i = 0; i < node.prim_count; ++i) {
+                if (prims[node.offset + i]->occluded(ray, range)) {
+                    any_hit = true;
+                    return true;
+                }
+            }
+            return false;
+        });
+    return any_hit;
+}
+
+int LinearBVH::intersect_packet(RayPacket &packet, int mask, Hit *hits) const {
+    int hit_mask;
+    bool coherent = traverse_linear_packet(nodes, depth, packet, mask, hit_mask,
+        [&](const BVH_LinearNode &node, int lanes) {
+            int leaf_mask = 0;
+            for (uint32_t i = 0; i < node.prim_count; ++i) {
+                const auto &prim = prims[node.offset + i];
+                leaf_mask |= prim->intersect_packet(packet, lanes, hits);
+            }
+            return leaf_mask;
+        });
+    if (!coherent) {
+        return Entity::intersect_packet(packet, mask, hits);
+    }
+    return hit_mask;
+}
+
+TriangleBVH::TriangleBVH(const std::vector<Vec3> &vertecies,
+                         const std::vector<uint32_t> &indices,
+                         const BVH_Options &options)
+    : depth(0)
+{
+    // Triangle entities are only needed while building, for their
+    // bounds and to clip them in spatial splits
+    size_t count = indices.size() / 3;
+    if (count == 0) {
+        return;
+    }
+    std::vector<Triangle> tris(count);
+    std::vector<const Entity *> prims(count);
+    for (size_t i = 0; i < count; ++i) {
+        tris[i] = Triangle(vertecies[indices[3*i]],
+                           vertecies[indices[3*i + 1]],
+                           vertecies[indices[3*i + 2]],
+                           nullptr);
+        prims[i] = &tris[i];
+    }
+    std::vector<uint32_t> order;
+    build_linear(prims, options, nodes, order, depth);
+
+    // Reorder the indices so each leaf covers a contiguous range. Spatial
+    // splits may put a triangle in several leaves, each leaf gets its own
+    // copy of its indices.
+    vertices = vertecies;
+    this->indices.reserve(3 * order.size());
+    for (auto &node : nodes) {
+        if (node.prim_count == 0) {
+            continue;
+        }
+        uint32_t first = this->indices.size() / 3;
+        for (uint32_t i = 0; i < node.prim_count; ++i) {
+            const uint32_t *tri = &indices[3 * order[node.offset + i]];
+            this->indices.insert(this->indices.end(), tri, tri + 3);
+        }
+        node.offset = first;
+    }
+    if (!options.triangle_blocks) {
+        return;
+    }
+
+    // Each leaf starts a new block, its triangles are renumbered to
+    // match. The buffers are not needed once the blocks are built.
+    std::vector<TriangleBlock> leaf_blocks;
+    for (auto &node : nodes) {
+        if (node.prim_count == 0) {
+            continue;
+        }
+        uint32_t first = leaf_blocks.size() * TriangleBlock::Size;
+        for (uint32_t i = 0; i < node.prim_count; i += TriangleBlock::Size) {
+            uint32_t count = std::min<uint32_t>(TriangleBlock::Size,
+                                                node.prim_count - i);
+            TriangleBlock temp;
+            leaf_blocks.push_back(block(node.offset + i, count, temp));
+        }
+        node.offset = first;
+    }
+    blocks = std::move(leaf_blocks);
+    vertices = std::vector<Vec3>();
+    this->indices = std::vector<uint32_t>();
+}
+
+// Möller-Trumbore test of a ray against the triangles of a block. Returns
+// the mask of triangles hit within range and writes their distances and
+// the barycentric coordinates of v1 (u) and v2 (v).
+inline int intersect_block(const TriangleBlock &block,
+                           const Ray &ray, Range range,
+                           float *dist, float *u, float *v)
+{
+#if defined(__SSE__)
+    __m128 dx = _mm_set1_ps(ray.direction.x);
+    __m128 dy = _mm_set1_ps(ray.direction.y);
+    __m128 dz = _mm_set1_ps(ray.direction.z);
+    __m128 e1x = _mm_load_ps(block.e1_x);
+    __m128 e1y = _mm_load_ps(block.e1_y);
+    __m128 e1z = _mm_load_ps(block.e1_z);
+    __m128 e2x = _mm_load_ps(block.e2_x);
+    __m128 e2y = _mm_load_ps(block.e2_y);
+    __m128 e2z = _mm_load_ps(block.e2_z);
+
+    // p = direction x e2
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+                            _mm_mul_ps(e1z, pz));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    // t = origin - v0
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_load_ps(block.v0_x));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_load_ps(block.v0_y));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_load_ps(block.v0_z));
+    __m128 uu = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)),
+                   _mm_mul_ps(tz, pz)), inv_det);
+
+    // q = t x e1
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 vv = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                   _mm_mul_ps(dz, qz)), inv_det);
+    __m128 tt = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                   _mm_mul_ps(e2z, qz)), inv_det);
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 hit = _mm_cmpneq_ps(det, zero);
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(uu, zero));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(vv, zero));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.0f)));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(tt, _mm_set1_ps(range.min)));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(tt, _mm_set1_ps(range.max)));
+
+    _mm_storeu_ps(dist, tt);
+    _mm_storeu_ps(u, uu);
+    _mm_storeu_ps(v, vv);
+    return _mm_movemask_ps(hit);
+#else
+    int mask = 0;
+    for (int i = 0; i < TriangleBlock::Size; ++i) {
+        Vec3 e1(block.e1_x[i], block.e1_y[i], block.e1_z[i]);
+        Vec3 e2(block.e2_x[i], block.e2_y[i], block.e2_z[i]);
+        Vec3 p = Vec3::cross(ray.direction, e2);
+        float det = Vec3::dot(e1, p);
+        if (det == 0) {
+            continue;
+        }
+        float inv_det = 1.0f / det;
+        Vec3 t = ray.origin - Vec3(block.v0_x[i], block.v0_y[i], block.v0_z[i]);
+        Vec3 q = Vec3::cross(t, e1);
+        u[i] = Vec3::dot(t, p) * inv_det;
+        v[i] = Vec3::dot(ray.direction, q) * inv_det;
+        dist[i] = Vec3::dot(e2, q) * inv_det;
+        if (u[i] >= 0 && v[i] >= 0 && u[i] + v[i] <= 1
+            && dist[i] >= range.min && dist[i] <= range.max) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+// Closest triangle found so far
+struct TriangleHit {
+    uint32_t tri;
+    float dist, u, v;
+};
+
+// Intersects a block of the triangles of a TriangleBVH starting at
+// first, shrinking range to the closest hit
+static bool intersect_closest(const TriangleBlock &block, uint32_t first,
+                              const Ray &ray, Range &range,
+                              TriangleHit &closest)
+{
+    float dist[TriangleBlock::Size];
+    float u[TriangleBlock::Size];
+    float v[TriangleBlock::Size];
+    int mask = intersect_block(block, ray, range, dist, u, v);
+
+    bool any_hit = false;
+    for (int i = 0; i < TriangleBlock::Size; ++i) {
+        if ((mask & (1 << i)) && dist[i] <= range.max) {
+            closest = TriangleHit{first + i, dist[i], u[i], v[i]};
+            range.max = dist[i];
+            any_hit = true;
+        }
+    }
+    return any_hit;
+}
+
+// Intersects the triangles of a leaf, shrinking range to the closest hit
+inline bool intersect_leaf(const TriangleBVH &bvh,
+                           const BVH_LinearNode &node,
+                           const Ray &ray, Range &range,
+                           TriangleHit &closest)
+{
+    bool any_hit = false;
+    uint32_t end = node.offset + node.prim_count;
+    for (uint32_t i = node.offset; i < end; i += TriangleBlock::Size) {
+        TriangleBlock temp;
+        const TriangleBlock &block =
+            bvh.block(i, std::min<uint32_t>(TriangleBlock::Size, end - i), temp);
+        any_hit |= intersect_closest(block, i, ray, range, closest);
+    }
+    return any_hit;
+}
+
+// Fills in the hit attributes of the closest triangle
+static void resolve_hit(const TriangleBVH &bvh,
+                        const Ray &ray, const TriangleHit &closest,
+                        Hit &hit)
+{
+    Vec3 e1, e2;
+    if (!bvh.blocks.empty()) {
+        const TriangleBlock &block = bvh.blocks[closest.tri / TriangleBlock::Size];
+        int lane = closest.tri % TriangleBlock::Size;
+        e1 = Vec3(block.e1_x[lane], block.e1_y[lane], block.e1_z[lane]);
+        e2 = Vec3(block.e2_x[lane], block.e2_y[lane], block.e2_z[lane]);
+    } else {
+        const uint32_t *tri = &bvh.indices[3 * closest.tri];
+        const Vec3 &v0 = bvh.vertices[tri[0]];
+        e1 = bvh.vertices[tri[1]] - v0;
+        e2 = bvh.vertices[tri[2]] - v0;
+    }
+
+    hit.dist = closest.dist;
+    hit.position = ray.at(closest.dist);
+    hit.normal = Vec3::cross(e1, e2).normalized();
+
+    // Barycentric coordinates of v0 and v1
+    hit.uv = Vec3(1.0f - closest.u - closest.v, closest.u, 0);
+    face_normal(ray, hit);
+}
+
+bool TriangleBVH::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
+    TriangleHit closest;
+    bool any_hit = false;
+    traverse_linear(nodes, depth, ray, range,
+        [&](const BVH_LinearNode &node, Range &range) {
+            any_hit |= intersect_leaf(*this, node, ray, range, closest);
+            return false;
+        });
+    if (any_hit) {
+        resolve_hit(*this, ray, closest, hit);
+    }
+    return any_hit;
+}
+
+bool TriangleBVH::occluded(const Ray &ray, Range range) const {
+    bool any_hit = false;
+    traverse_linear(nodes, depth, ray, range,
+        [&](const BVH_LinearNode &node, Range &range) {
+            TriangleHit closest;
+            any_hit = intersect_leaf(*this, node, ray, range, closest);
+            return any_hit;
+        });
+    return any_hit;
+}
+
+int TriangleBVH::intersect_packet(RayPacket &packet, int mask, Hit *hits) const {
+    TriangleHit closest[RayPacket::Size];
+    int hit_mask;
+    bool coherent = traverse_linear_packet(nodes, depth, packet, mask, hit_mask,
+        [&](const BVH_LinearNode &node, int lanes) {
+            // Each block is gathered once for all lanes
+            int leaf_mask = 0;
+            uint32_t end = node.offset + node.prim_count;
+            for (uint32_t b = node.offset; b < end; b += TriangleBlock::Size) {
+                TriangleBlock temp;
+                const TriangleBlock &block =
+                    this->block(b, std::min<uint32_t>(TriangleBlock::Size, end - b), temp);
+                for (int i = 0; i < RayPacket::Size; ++i) {
+                    if (!(lanes & (1 << i))) {
+                        continue;
+                    }
+                    Range range = packet.range(i);
+                    if (intersect_closest(block, b, packet.rays[i],
+                                          range, closest[i])) {
+                        packet.max_dist[i] = range.max;
+                        leaf_mask |= 1 << i;
+                    }
+                }
+            }
+            return leaf_mask;
+        });
+
+    if (!coherent) {
+        hit_mask = 0;
+        for (int i = 0; i < RayPacket::Size; ++i) {
+            if ((mask & (1 << i))
+                && ray_intersect(packet.rays[i], packet.range(i), hits[i])) {
+                packet.max_dist[i] = hits[i].dist;
+                hit_mask |= 1 << i;
+            }
+        }
+        return hit_mask;
+    }
+    for (int i = 0; i < RayPacket::Size; ++i) {
+        if (hit_mask & (1 << i)) {
+            resolve_hit(*this, packet.rays[i], closest[i], hits[i]);
+        }
+    }
+    return hit_mask;
+}
+
+SphereSet::SphereSet(const std::vector<Sphere> &spheres,
+                     const BVH_Options &options)
+    : depth(0)
+{
+    if (!spheres.empty()) {
+        std::vector<const Entity *> prims(spheres.size());
+        for (size_t i = 0; i < spheres.size(); ++i) {
+            prims[i] = &spheres[i];
+        }
+        std::vector<uint32_t> order;
+        build_linear(prims, options, nodes, order, depth);
+
+        for (uint32_t i : order) {
+            const Sphere *sphere = &spheres[i];
+            x.push_back(sphere->position.x);
+            y.push_back(sphere->position.y);
+            z.push_back(sphere->position.z);
+            radius.push_back(sphere->radius);
+            materials.push_back(sphere->material);
+        }
+    }
+    x.resize(x.size() + Width, 0.0f);
+    y.resize(y.size() + Width, 0.0f);
+    z.resize(z.size() + Width, 0.0f);
+    radius.resize(radius.size() + Width, 0.0f);
+}
+
+// Closest sphere found so far
+struct SphereHit {
+    uint32_t index;
+    float dist;
+};
+
+// Tests a ray against spheres first to first + SphereSet::Width. Returns
+// the mask of spheres hit within range and writes their distances.
+inline int intersect_spheres(const SphereSet &set, uint32_t first,
+                             const Ray &ray, Range range, float *dist)
+{
+    float a = ray.direction.length_sqr();
+    float inv_a = 1.0f / a;
+#if defined(__AVX__)
+    __m256 cx = _mm256_loadu_ps(&set.x[first]);
+    __m256 cy = _mm256_loadu_ps(&set.y[first]);
+    __m256 cz = _mm256_loadu_ps(&set.z[first]);
+    __m256 r = _mm256_loadu_ps(&set.radius[first]);
+
+    __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), cx);
+    __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), cy);
+    __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), cz);
+
+    __m256 half_b = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(ocx, _mm256_set1_ps(ray.direction.x)),
+                      _mm256_mul_ps(ocy, _mm256_set1_ps(ray.direction.y))),
+        _mm256_mul_ps(ocz, _mm256_set1_ps(ray.direction.z)));
+    __m256 c = _mm256_sub_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)),
+                      _mm256_mul_ps(ocz, ocz)),
+        _mm256_mul_ps(r, r));
+    __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(half_b, half_b),
+                                        _mm256_mul_ps(_mm256_set1_ps(a), c));
+    __m256 root = _mm256_sqrt_ps(_mm256_max_ps(discriminant, _mm256_setzero_ps()));
+
+    __m256 scale = _mm256_set1_ps(inv_a);
+    __m256 near = _mm256_mul_ps(_mm256_sub_ps(_mm256_setzero_ps(),
+                                              _mm256_add_ps(half_b, root)), scale);
+    __m256 far = _mm256_mul_ps(_mm256_sub_ps(root, half_b), scale);
+
+    __m256 min = _mm256_set1_ps(range.min);
+    __m256 max = _mm256_set1_ps(range.max);
+    __m256 near_ok = _mm256_and_ps(_mm256_cmp_ps(near, min, _CMP_GT_OQ),
+                                   _mm256_cmp_ps(near, max, _CMP_LT_OQ));
+    __m256 far_ok = _mm256_and_ps(_mm256_cmp_ps(far, min, _CMP_GT_OQ),
+                                  _mm256_cmp_ps(far, max, _CMP_LT_OQ));
+    __m256 hit = _mm256_and_ps(
+        _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ),
+        _mm256_or_ps(near_ok, far_ok));
+
+    _mm256_storeu_ps(dist, _mm256_blendv_ps(far, near, near_ok));
+    return _mm256_movemask_ps(hit);
+#elif defined(__SSE__)
+    int mask = 0;
+    for (int half = 0; half < SphereSet::Width; half += 4) {
+        uint32_t i = first + half;
+        __m128 cx = _mm_loadu_ps(&set.x[i]);
+        __m128 cy = _mm_loadu_ps(&set.y[i]);
+        __m128 cz = _mm_loadu_ps(&set.z[i]);
+        __m128 r = _mm_loadu_ps(&set.radius[i]);
+
+        __m128 ocx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), cx);
+        __m128 ocy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), cy);
+        __m128 ocz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), cz);
+
+        __m128 half_b = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(ocx, _mm_set1_ps(ray.direction.x)),
+                       _mm_mul_ps(ocy, _mm_set1_ps(ray.direction.y))),
+            _mm_mul_ps(ocz, _mm_set1_ps(ray.direction.z)));
+        __m128 c = _mm_sub_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)),
+                       _mm_mul_ps(ocz, ocz)),
+            _mm_mul_ps(r, r));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(half_b, half_b),
+                                         _mm_mul_ps(_mm_set1_ps(a), c));
+        __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+
+        __m128 scale = _mm_set1_ps(inv_a);
+        __m128 near = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(),
+                                            _mm_add_ps(half_b, root)), scale);
+        __m128 far = _mm_mul_ps(_mm_sub_ps(root, half_b), scale);
+
+        __m128 min = _mm_set1_ps(range.min);
+        __m128 max = _mm_set1_ps(range.max);
+        __m128 near_ok = _mm_and_ps(_mm_cmpgt_ps(near, min), _mm_cmplt_ps(near, max));
+        __m128 far_ok = _mm_and_ps(_mm_cmpgt_ps(far, min), _mm_cmplt_ps(far, max));
+        __m128 hit = _mm_and_ps(_mm_cmpgt_ps(discriminant, _mm_setzero_ps()),
+                                _mm_or_ps(near_ok, far_ok));
+
+        // Pick near where it is in range, far otherwise
+        __m128 t = _mm_or_ps(_mm_and_ps(near_ok, near), _mm_andnot_ps(near_ok, far));
+        _mm_storeu_ps(dist + half, t);
+        mask |= _mm_movemask_ps(hit) << half;
+    }
+    return mask;
+#else
+    int mask = 0;
+    for (int i = 0; i < SphereSet::Width; ++i) {
+        Vec3 oc = ray.origin - Vec3(set.x[first + i], set.y[first + i], set.z[first + i]);
+        float half_b = Vec3::dot(oc, ray.direction);
+        float r = set.radius[first + i];
+        float c = oc.length_sqr() - r*r;
+        float discriminant = half_b*half_b - a*c;
+        if (discriminant <= 0) {
+            continue;
+        }
+        float root = sqrtf(discriminant);
+        float t = (-half_b - root) * inv_a;
+        if (t >= range.max || t <= range.min) {
+            t = (-half_b + root) * inv_a;
+            if (t >= range.max || t <= range.min) {
+                continue;
+            }
+        }
+        dist[i] = t;
+        mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Intersects the spheres of a leaf, shrinking range to the closest hit
+static bool intersect_leaf(const SphereSet &set,
+                           const BVH_LinearNode &node,
+                           const Ray &ray, Range &range,
+                           SphereHit &closest)
+{
+    bool any_hit = false;
+    uint32_t end = node.offset + node.prim_count;
+    for (uint32_t first = node.offset; first < end; first += SphereSet::Width) {
+        float dist[SphereSet::Width];
+        int mask = intersect_spheres(set, first, ray, range, dist);
+        if (end - first < uint32_t(SphereSet::Width)) {
+            mask &= (1 << (end - first)) - 1;
+        }
+        for (int i = 0; i < SphereSet::Width; ++i) {
+            if ((mask & (1 << i)) && dist[i] < range.max) {
+                closest = SphereHit{first + i, dist[i]};
+                range.max = dist[i];
+                any_hit = true;
+            }
+        }
+    }
+    return any_hit;
+}
+
+// Fills in the hit attributes of the closest sphere
+static void resolve_hit(const SphereSet &set,
+                        const Ray &ray, const SphereHit &closest,
+                        Hit &hit)
+{
+    uint32_t i = closest.index;
+    Vec3 center(set.x[i], set.y[i], set.z[i]);
+    float radius = set.radius[i];
+
+    hit.dist = closest.dist;
+    hit.position = ray.at(closest.dist);
+    hit.normal = ((hit.position - center) / radius).normalized();
+    hit.material = set.materials[i];
+    hit.uv = sphere_uv((hit.position - center) / radius);
+    face_normal(ray, hit);
+}
+
+bool SphereSet::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
+    SphereHit closest;
+    bool any_hit = false;
+    traverse_linear(nodes, depth, ray, range,
+        [&](const BVH_LinearNode &node, Range &range) {
+            any_hit |= intersect_leaf(*this, node, ray, range, closest);
+            return false;
+        });
+    if (any_hit) {
+        resolve_hit(*this, ray, closest, hit);
+    }
+    return any_hit;
+}
+
+bool SphereSet::occluded(const Ray &ray, Range range) const {
+    bool any_hit = false;
+    traverse_linear(nodes, depth, ray, range,
+        [&](const BVH_LinearNode &node, Range &range) {
+            SphereHit closest;
+            any_hit = intersect_leaf(*this, node, ray, range, closest);
+            return any_hit;
+        });
+    return any_hit;
+}
+
+int SphereSet::intersect_packet(RayPacket &packet, int mask, Hit *hits) const {
+    SphereHit closest[RayPacket::Size];
+    int hit_mask;
+    bool coherent = traverse_linear_packet(nodes, depth, packet, mask, hit_mask,
+        [&](const BVH_LinearNode &node, int lanes) {
+            int leaf_mask = 0;
+            for (int i = 0; i < RayPacket::Size; ++i) {
+                if (!(lanes & (1 << i))) {
+                    continue;
+                }
+                Range range = packet.range(i);
+                if (intersect_leaf(*this, node, packet.rays[i], range, closest[i])) {
+                    packet.max_dist[i] = range.max;
+                    leaf_mask |= 1 << i;
+                }
+            }
+            return leaf_mask;
+        });
+
+    if (!coherent) {
+        return Entity::intersect_packet(packet, mask, hits);
+    }
+    for (int i = 0; i < RayPacket::Size; ++i) {
+        if (hit_mask & (1 << i)) {
+            resolve_hit(*this, packet.rays[i], closest[i], hits[i]);
+        }
+    }
+    return hit_mask;
+}
+
+bool SphereSet::bounding_box(Aabb &box) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    box = nodes[0].aabb;
+    return true;
+}
+
+// Array of a Scene an entity is copied into
+inline PrimType prim_type(const Entity *entity) {
+    if (dynamic_cast<const Sphere *>(entity)) {
+        return PrimType::Sphere;
+    }
+    if (dynamic_cast<const Triangle *>(entity)) {
+        return PrimType::Triangle;
+    }
+    if (dynamic_cast<const PlaneXY *>(entity)
+        || dynamic_cast<const PlaneXZ *>(entity)
+        || dynamic_cast<const PlaneYZ *>(entity)) {
+        return PrimType::Quad;
+    }
+    if (dynamic_cast<const Box *>(entity)) {
+        return PrimType::Box;
+    }
+    return PrimType::Entity;
+}
+
+// A Flip of a primitive with an array is stored in that array with
+// PrimRef::flip set, and an Instance of a box as a placed box with the
+// inverse transform of the instance. Returns the type and replaces entity
+// with the primitive itself.
+static PrimType prim_type(const Entity *&entity, bool &flip,
+                          const Transform *&to_local)
+{
+    const Entity *prim = entity;
+    bool flipped = false;
+    const Transform *transform = nullptr;
+    if (auto f = dynamic_cast<const Flip *>(prim)) {
+        prim = f->e.get();
+        flipped = true;
+    }
+    if (auto instance = dynamic_cast<const Instance *>(prim)) {
+        if (dynamic_cast<const Box *>(instance->entity.get())) {
+            prim = instance->entity.get();
+            transform = &instance->inv_transform;
+        }
+    }
+
+    flip = false;
+    to_local = nullptr;
+    PrimType type = prim_type(prim);
+    if (type == PrimType::Box && transform) {
+        type = PrimType::PlacedBox;
+    }
+    if (type != PrimType::Entity) {
+        entity = prim;
+        flip = flipped;
+        to_local = transform;
+    }
+    return type;
+}
+
+inline SceneQuad make_quad(const Entity *entity) {
+    if (auto p = dynamic_cast<const PlaneXY *>(entity)) {
+        return SceneQuad{p->z, p->x0, p->x1, p->y0, p->y1, 2, p->material};
+    }
+    if (auto p = dynamic_cast<const PlaneXZ *>(entity)) {
+        return SceneQuad{p->y, p->x0, p->x1, p->z0, p->z1, 1, p->material};
+    }
+    auto p = static_cast<const PlaneYZ *>(entity);
+    return SceneQuad{p->x, p->y0, p->y1, p->z0, p->z1, 0, p->material};
+}
+
+inline bool is_translation(const Transform &t) {
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            if (t.m[i][j] != (i == j ? 1.0f : 0.0f)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Entity moved into world space where it stays a primitive of the same
+// type, null if it does not.
+static std::shared_ptr<Entity> bake_entity(const Entity *entity,
+                                           const Transform &t)
+{
+    if (auto tri = dynamic_cast<const Triangle *>(entity)) {
+        return std::make_shared<Triangle>(t.point(tri->v0), t.point(tri->v1),
+                                          t.point(tri->v2), tri->material);
+    }
+    if (!is_translation(t)) {
+        // Rotated spheres would rotate their uv, and the others would no
+        // longer be axis aligned.
+        return nullptr;
+    }
+    Vec3 d(t.m[0][3], t.m[1][3], t.m[2][3]);
+    if (auto s = dynamic_cast<const Sphere *>(entity)) {
+        return std::make_shared<Sphere>(s->position + d, s->radius, s->material);
+    }
+    if (auto p = dynamic_cast<const PlaneXY *>(entity)) {
+        return std::make_shared<PlaneXY>(p->x0 + d.x, p->x1 + d.x,
+                                         p->y0 + d.y, p->y1 + d.y,
+                                         p->z + d.z, p->material);
+    }
+    if (auto p = dynamic_cast<const PlaneXZ *>(entity)) {
+        return std::make_shared<PlaneXZ>(p->x0 + d.x, p->x1 + d.x,
+                                         p->z0 + d.z, p->z1 + d.z,
+                                         p->y + d.y, p->material);
+    }
+    if (auto p = dynamic_cast<const PlaneYZ *>(entity)) {
+        return std::make_shared<PlaneYZ>(p->y0 + d.y, p->y1 + d.y,
+                                         p->z0 + d.z, p->z1 + d.z,
+                                         p->x + d.x, p->material);
+    }
+    if (auto b = dynamic_cast<const Box *>(entity)) {
+        return std::make_shared<Box>(b->box_min + d, b->box_max + d, b->material);
+    }
+    return nullptr;
+}
+
+void collect_prims(const BVH_Node &node,
+                   std::vector<std::shared_ptr<Entity>> &prims)
+{
+    if (node.is_leaf()) {
+        prims.insert(prims.end(), node.prims.begin(), node.prims.end());
+        return;
+    }
+    collect_prims(*node.left, prims);
+    collect_prims(*node.right, prims);
+}
+
+// Compile pass of a Scene, appends entity to entities in world space.
+// The wrappers above it were folded into transform and flip by
+// walk_placed. Primitives are baked into world space where possible,
+// anything else is placed by one Instance with the combined transform.
+// Instances of boxes are stored as boxes by the Scene.
+static void compile_entity(const std::shared_ptr<Entity> &entity,
+                           const Transform &transform, bool flip,
+                           std::vector<std::shared_ptr<Entity>> &entities)
+{
+    std::shared_ptr<Entity> placed = entity;
+    if (!transform.is_identity()) {
+        placed = bake_entity(entity.get(), transform);
+        if (!placed) {
+            placed = std::make_shared<Instance>(entity, transform);
+        }
+    }
+    if (flip) {
+        placed = std::make_shared<Flip>(placed);
+    }
+    entities.push_back(placed);
+}
+
+Scene::Scene(World &world, const BVH_Options &options) : depth(0) {
+    std::vector<std::shared_ptr<Entity>> flat;
+    auto compile = [&](const std::shared_ptr<Entity> &entity,
+                       const Transform &transform, bool flip) {
+        compile_entity(entity, transform, flip, flat);
+    };
+    for (const auto &entity : world.entities) {
+        walk_placed(entity, Transform(), false, compile);
+    }
+    if (flat.empty()) {
+        return;
+    }
+    LinearBVH bvh(BVH_Node(flat, 0, flat.size(), options));
+    nodes = bvh.nodes;
+    depth = bvh.depth;
+
+    for (const auto &node : nodes) {
+        if (node.prim_count == 0) {
+            continue;
+        }
+        auto first = bvh.prims.begin() + node.offset;
+        std::stable_sort(first, first + node.prim_count,
+            [](const std::shared_ptr<Entity> &a, const std::shared_ptr<Entity> &b) {
+                const Entity *ea = a.get();
+                const Entity *eb = b.get();
+                bool flip;
+                const Transform *to_local;
+                return prim_type(ea, flip, to_local) < prim_type(eb, flip, to_local);
+            });
+    }
+
+    // Spatial splits may reference a primitive from several leaves, each
+    // leaf gets its own copy.
+    prims.reserve(bvh.prims.size());
+    for (const auto &entity : bvh.prims) {
+        const Entity *prim = entity.get();
+        bool flip;
+        const Transform *to_local;
+        PrimType type = prim_type(prim, flip, to_local);
+        uint32_t index = 0;
+        switch (type) {
+        case PrimType::Sphere: {
+            auto s = static_cast<const Sphere *>(prim);
+            index = spheres.size();
+            spheres.push_back(SceneSphere{s->position, s->radius, s->material});
+            break;
+        }
+        case PrimType::Triangle: {
+            auto t = static_cast<const Triangle *>(prim);
+            index = triangles.size();
+            triangles.push_back(SceneTriangle{t->v0, t->v1 - t->v0, t->v2 - t->v0,
+                                              t->material});
+            break;
+        }
+        case PrimType::Quad:
+            index = quads.size();
+            quads.push_back(make_quad(prim));
+            break;
+        case PrimType::Box: {
+            auto b = static_cast<const Box *>(prim);
+            index = boxes.size();
+            boxes.push_back(SceneBox{b->box_min, b->box_max, b->material});
+            break;
+        }
+        case PrimType::PlacedBox: {
+            auto b = static_cast<const Box *>(prim);
+            index = placed_boxes.size();
+            placed_boxes.push_back(ScenePlacedBox{
+                SceneBox{b->box_min, b->box_max, b->material}, *to_local});
+            break;
+        }
+        case PrimType::Entity:
+            index = entities.size();
+            entities.push_back(entity);
+            break;
+        }
+        prims.push_back(PrimRef{index, type, flip});
+    }
+}
+
+// Closest primitive of a Scene found so far. Triangles also record the
+// barycentric coordinates of the hit, boxes the axis of the face hit and
+// whether it is the max face.
+struct SceneHit {
+    PrimRef prim;
+    float dist, u, v;
+    int axis;
+    bool max_face;
+};
+
+// Same test as Sphere::ray_intersect
+inline bool intersect_prim(const SceneSphere &sphere, const Ray &ray,
+                           Range range, float &dist)
+{
+    Vec3 oc = ray.origin - sphere.center;
+    float a = ray.direction.length_sqr();
+    float half_b = Vec3::dot(oc, ray.direction);
+    float c = oc.length_sqr() - sphere.radius*sphere.radius;
+    float discriminant = half_b*half_b - a*c;
+
+    if (discriminant <= 0) {
+        return false;
+    }
+
+    float root = sqrtf(discriminant);
+    dist = (-half_b - root) / a;
+    if (dist >= range.max || dist <= range.min) {
+        dist = (-half_b + root) / a;
+        if (dist >= range.max || dist <= range.min) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Scalar version of intersect_block
+static bool intersect_prim(const SceneTriangle &tri, const Ray &ray,
+                           Range range, float &dist, float &u, float &v)
+{
+    Vec3 p = Vec3::cross(ray.direction, tri.e2);
+    float det = Vec3::dot(tri.e1, p);
+    if (det == 0) {
+        return false;
+    }
+    float inv_det = 1.0f / det;
+    Vec3 t = ray.origin - tri.v0;
+    u = Vec3::dot(t, p) * inv_det;
+    if (u < 0 || u > 1) {
+        return false;
+    }
+    Vec3 q = Vec3::cross(t, tri.e1);
+    v = Vec3::dot(ray.direction, q) * inv_det;
+    if (v < 0 || u + v > 1) {
+        return false;
+    }
+    dist = Vec3::dot(tri.e2, q) * inv_det;
+    return dist >= range.min && dist <= range.max;
+}
+
+// Same test as PlaneXY::ray_intersect on any axis
+inline bool intersect_prim(const SceneQuad &quad, const Ray &ray,
+                           Range range, float &dist)
+{
+    int u_axis = quad.axis == 0 ? 1 : 0;
+    int v_axis = quad.axis == 2 ? 1 : 2;
+    dist = (quad.k - ray.origin[quad.axis]) / ray.direction[quad.axis];
+    if (dist < range.min || dist > range.max) {
+        return false;
+    }
+    float u = ray.origin[u_axis] + dist*ray.direction[u_axis];
+    float v = ray.origin[v_axis] + dist*ray.direction[v_axis];
+    return !(u < quad.u0 || u > quad.u1 || v < quad.v0 || v > quad.v1);
+}
+
+// Same test as Box::ray_intersect, also returns the face hit
+inline bool intersect_prim(const SceneBox &box, const Ray &ray,
+                           Range range, float &dist, int &axis, bool &max_face)
+{
+    float t_near = -Infinity;
+    float t_far = Infinity;
+    int near_axis = 0;
+    int far_axis = 0;
+    for (int a = 0; a < 3; ++a) {
+        float inv_dir = 1.0f / ray.direction[a];
+        float t0 = (box.box_min[a] - ray.origin[a]) * inv_dir;
+        float t1 = (box.box_max[a] - ray.origin[a]) * inv_dir;
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        if (t0 > t_near) {
+            t_near = t0;
+            near_axis = a;
+        }
+        if (t1 < t_far) {
+            t_far = t1;
+            far_axis = a;
+        }
+    }
+    if (t_near > t_far) {
+        return false;
+    }
+    if (t_near >= range.min && t_near <= range.max) {
+        dist = t_near;
+        axis = near_axis;
+        max_face = ray.direction[axis] < 0;
+        return true;
+    }
+    if (t_far >= range.min && t_far <= range.max) {
+        dist = t_far;
+        axis = far_axis;
+        max_face = ray.direction[axis] >= 0;
+        return true;
+    }
+    return false;
+}
+
+// Ray in the space of a placed box. Directions are not normalized, so
+// distances along the ray are the same in both spaces.
+inline Ray box_ray(const ScenePlacedBox &placed, const Ray &ray) {
+    return Ray(placed.to_local.point(ray.origin),
+               placed.to_local.vector(ray.direction));
+}
+
+// Intersects the primitives of a leaf, shrinking range to the closest
+// hit. Entities write their hits to hit directly, the attributes of the
+// other types are left to resolve_hit. With AnyHit the first hit ends
+// the test and nothing is written.
+template <bool AnyHit>
+static bool intersect_leaf(const Scene &scene,
+                           const BVH_LinearNode &node,
+                           const Ray &ray, Range &range,
+                           SceneHit &closest, Hit &hit)
+{
+    bool leaf_hit = false;
+    uint32_t end = node.offset + node.prim_count;
+    for (uint32_t i = node.offset; i < end; ++i) {
+        PrimRef prim = scene.prims[i];
+        float dist = 0, u = 0, v = 0;
+        int axis = 0;
+        bool max_face = false;
+        bool is_hit = false;
+
+        switch (prim.type) {
+        case PrimType::Sphere:
+            is_hit = intersect_prim(scene.spheres[prim.index], ray, range, dist);
+            break;
+        case PrimType::Triangle:
+            is_hit = intersect_prim(scene.triangles[prim.index], ray, range,
+                                    dist, u, v);
+            break;
+        case PrimType::Quad:
+            is_hit = intersect_prim(scene.quads[prim.index], ray, range, dist);
+            break;
+        case PrimType::Box:
+            is_hit = intersect_prim(scene.boxes[prim.index], ray, range,
+                                    dist, axis, max_face);
+            break;
+        case PrimType::PlacedBox: {
+            const auto &placed = scene.placed_boxes[prim.index];
+            is_hit = intersect_prim(placed.box, box_ray(placed, ray), range,
+                                    dist, axis, max_face);
+            break;
+        }
+        case PrimType::Entity: {
+            const auto &entity = scene.entities[prim.index];
+            if (AnyHit) {
+                is_hit = entity->occluded(ray, range);
+            } else if (entity->ray_intersect(ray, range, hit)) {
+                is_hit = true;
+                dist = hit.dist;
+            }
+            break;
+        }
+        }
+
+        if (is_hit) {
+            if (AnyHit) {
+                return true;
+            }
+            closest = SceneHit{prim, dist, u, v, axis, max_face};
+            range.max = dist;
+            leaf_hit = true;
+        }
+    }
+    return leaf_hit;
+}
+
+// Fills in the uv, material and normal of a box hit. ray and the normal
+// are in the space of the box.
+static void resolve_box(const SceneBox &box, const Ray &ray,
+                        const SceneHit &closest, Hit &hit)
+{
+    int u_axis = closest.axis == 0 ? 1 : 0;
+    int v_axis = closest.axis == 2 ? 1 : 2;
+    Vec3 p = ray.at(closest.dist);
+    hit.uv.x = (p[u_axis] - box.box_min[u_axis])
+             / (box.box_max[u_axis] - box.box_min[u_axis]);
+    hit.uv.y = (p[v_axis] - box.box_min[v_axis])
+             / (box.box_max[v_axis] - box.box_min[v_axis]);
+    hit.normal = Vec3();
+    hit.normal.a[closest.axis] = closest.max_face ? 1.0f : -1.0f;
+    hit.material = box.material;
+}
+
+// Fills in the hit attributes of the closest primitive, unless it is an
+// entity which already did.
+static void resolve_hit(const Scene &scene,
+                        const Ray &ray, const SceneHit &closest,
+                        Hit &hit)
+{
+    uint32_t index = closest.prim.index;
+    switch (closest.prim.type) {
+    case PrimType::Sphere: {
+        const auto &sphere = scene.spheres[index];
+        hit.position = ray.at(closest.dist);
+        hit.normal = ((hit.position - sphere.center) / sphere.radius).normalized();
+        hit.uv = sphere_uv((hit.position - sphere.center) / sphere.radius);
+        hit.material = sphere.material;
+        break;
+    }
+    case PrimType::Triangle: {
+        const auto &tri = scene.triangles[index];
+        hit.position = ray.at(closest.dist);
+        hit.normal = Vec3::cross(tri.e1, tri.e2).normalized();
+
+        // Barycentric coordinates of v0 and v1, as for meshes
+        hit.uv = Vec3(1.0f - closest.u - closest.v, closest.u, 0);
+        hit.material = tri.material;
+        break;
+    }
+    case PrimType::Quad: {
+        const auto &quad = scene.quads[index];
+        int u_axis = quad.axis == 0 ? 1 : 0;
+        int v_axis = quad.axis == 2 ? 1 : 2;
+        hit.position = ray.at(closest.dist);
+        hit.uv.x = (hit.position[u_axis] - quad.u0) / (quad.u1 - quad.u0);
+        hit.uv.y = (hit.position[v_axis] - quad.v0) / (quad.v1 - quad.v0);
+        hit.normal = Vec3();
+        hit.normal.a[quad.axis] = 1.0f;
+        hit.material = quad.material;
+        break;
+    }
+    case PrimType::Box:
+        resolve_box(scene.boxes[index], ray, closest, hit);
+        hit.position = ray.at(closest.dist);
+        break;
+    case PrimType::PlacedBox: {
+        const auto &placed = scene.placed_boxes[index];
+        resolve_box(placed.box, box_ray(placed, ray), closest, hit);
+        hit.position = ray.at(closest.dist);
+        hit.normal = placed.to_local.normal(hit.normal).normalized();
+        break;
+    }
+    case PrimType::Entity:
+        return;
+    }
+    hit.dist = closest.dist;
+    face_normal(ray, hit);
+    if (closest.prim.flip) {
+        hit.face = hit.face == Hit::Front_Face ? Hit::Back_Face : Hit::Front_Face;
+    }
+}
+
+bool Scene::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
+    SceneHit closest;
+    bool any_hit = false;
+    traverse_linear(nodes, depth, ray, range,
+        [&](const BVH_LinearNode &node, Range &range) {
+            any_hit |= intersect_leaf<false>(*this, node, ray, range, closest, hit);
+            return false;
+        });
+    if (any_hit) {
+        resolve_hit(*this, ray, closest, hit);
+    }
+    return any_hit;
+}
+
+bool Scene::occluded(const Ray &ray, Range range) const {
+    bool any_hit = false;
+    traverse_linear(nodes, depth, ray, range,
+        [&](const BVH_LinearNode &node, Range &range) {
+            SceneHit closest;
+            Hit hit;
+            any_hit = intersect_leaf<true>(*this, node, ray, range, closest, hit);
+            return any_hit;
+        });
+    return any_hit;
+}
+
+int Scene::intersect_packet(RayPacket &packet, int mask, Hit *hits) const {
+    SceneHit closest[RayPacket::Size];
+    int hit_mask;
+    bool coherent = traverse_linear_packet(nodes, depth, packet, mask, hit_mask,
+        [&](const BVH_LinearNode &node, int lanes) {
+            int leaf_mask = 0;
+            for (int i = 0; i < RayPacket::Size; ++i) {
+                if (!(lanes & (1 << i))) {
+                    continue;
+                }
+                Range range = packet.range(i);
+                if (intersect_leaf<false>(*this, node, packet.rays[i], range,
+                                          closest[i], hits[i])) {
+                    packet.max_dist[i] = range.max;
+                    leaf_mask |= 1 << i;
+                }
+            }
+            return leaf_mask;
+        });
+
+    if (!coherent) {
+        return Entity::intersect_packet(packet, mask, hits);
+    }
+    for (int i = 0; i < RayPacket::Size; ++i) {
+        if (hit_mask & (1 << i)) {
+            resolve_hit(*this, packet.rays[i], closest[i], hits[i]);
+        }
+    }
+    return hit_mask;
+}
+
+bool Scene::bounding_box(Aabb &box) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    box = nodes[0].aabb;
+    return true;
+}
+
+// Slab test of a ray against the child boxes of a wide node. Returns a
+// bit mask of the children hit and writes their entry distances to dist.
+template <int Width>
+static int intersect_children(const BVH_WideNode<Width> &node,
+                              const Ray &ray, const Vec3 &inv_dir,
+                              Range range, float *dist)
+{
+    int mask = 0;
+    for (int i = 0; i < node.child_count; ++i) {
+        float t0x = (node.min_x[i] - ray.origin.x) * inv_dir.x;
+        float t1x = (node.max_x[i] - ray.origin.x) * inv_dir.x;
+        float t0y = (node.min_y[i] - ray.origin.y) * inv_dir.y;
+        float t1y = (node.max_y[i] - ray.origin.y) * inv_dir.y;
+        float t0z = (node.min_z[i] - ray.origin.z) * inv_dir.z;
+        float t1z = (node.max_z[i] - ray.origin.z) * inv_dir.z;
+        float tmin = fmaxf(fmaxf(fminf(t0x, t1x), fminf(t0y, t1y)),
+                           fmaxf(fminf(t0z, t1z), range.min));
+        float tmax = fminf(fminf(fmaxf(t0x, t1x), fmaxf(t0y, t1y)),
+                           fminf(fmaxf(t0z, t1z), range.max));
+        dist[i] = tmin;
+        mask |= int(tmin < tmax) << i;
+    }
+    return mask;
+}
+
+#if defined(__SSE__)
+// Slab test of a ray against 4 boxes in SoA layout
+inline int slab_test4(__m128 min_x, __m128 min_y, __m128 min_z,
+                      __m128 max_x, __m128 max_y, __m128 max_z,
+                      const Ray &ray, const Vec3 &inv_dir,
+                      Range range, float *dist)
+{
+    __m128 ox = _mm_set1_ps(ray.origin.x);
+    __m128 oy = _mm_set1_ps(ray.origin.y);
+    __m128 oz = _mm_set1_ps(ray.origin.z);
+    __m128 ix = _mm_set1_ps(inv_dir.x);
+    __m128 iy = _mm_set1_ps(inv_dir.y);
+    __m128 iz = _mm_set1_ps(inv_dir.z);
+
+    __m128 t0x = _mm_mul_ps(_mm_sub_ps(min_x, ox), ix);
+    __m128 t1x = _mm_mul_ps(_mm_sub_ps(max_x, ox), ix);
+    __m128 t0y = _mm_mul_ps(_mm_sub_ps(min_y, oy), iy);
+    __m128 t1y = _mm_mul_ps(_mm_sub_ps(max_y, oy), iy);
+    __m128 t0z = _mm_mul_ps(_mm_sub_ps(min_z, oz), iz);
+    __m128 t1z = _mm_mul_ps(_mm_sub_ps(max_z, oz), iz);
+
+    __m128 tmin = _mm_max_ps(
+        _mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+        _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(range.min)));
+    __m128 tmax = _mm_min_ps(
+        _mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+        _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(range.max)));
+
+    _mm_storeu_ps(dist, tmin);
+    return _mm_movemask_ps(_mm_cmplt_ps(tmin, tmax));
+}
+
+// Tests 4 child boxes starting at child index first
+template <int Width>
+inline int slab_test_sse(const BVH_WideNode<Width> &node, int first,
+                         const Ray &ray, const Vec3 &inv_dir,
+                         Range range, float *dist)
+{
+    int mask = slab_test4(_mm_loadu_ps(node.min_x + first),
+                          _mm_loadu_ps(node.min_y + first),
+                          _mm_loadu_ps(node.min_z + first),
+                          _mm_loadu_ps(node.max_x + first),
+                          _mm_loadu_ps(node.max_y + first),
+                          _mm_loadu_ps(node.max_z + first),
+                          ray, inv_dir, range, dist + first);
+    return mask << first;
+}
+
+template <>
+int intersect_children<4>(const BVH_WideNode<4> &node,
+                          const Ray &ray, const Vec3 &inv_dir,
+                          Range range, float *dist)
+{
+    int mask = slab_test_sse(node, 0, ray, inv_dir, range, dist);
+    return mask & ((1 << node.child_count) - 1);
+}
+
+template <>
+int intersect_children<8>(const BVH_WideNode<8> &node,
+                          const Ray &ray, const Vec3 &inv_dir,
+                          Range range, float *dist)
+{
+#if defined(__AVX__)
+    __m256 ox = _mm256_set1_ps(ray.origin.x);
+    __m256 oy = _mm256_set1_ps(ray.origin.y);
+    __m256 oz = _mm256_set1_ps(ray.origin.z);
+    __m256 ix = _mm256_set1_ps(inv_dir.x);
+    __m256 iy = _mm256_set1_ps(inv_dir.y);
+    __m256 iz = _mm256_set1_ps(inv_dir.z);
+
+    __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_x), ox), ix);
+    __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_x), ox), ix);
+    __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_y), oy), iy);
+    __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_y), oy), iy);
+    __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_z), oz), iz);
+    __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_z), oz), iz);
+
+    __m256 tmin = _mm256_max_ps(
+        _mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+        _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_set1_ps(range.min)));
+    __m256 tmax = _mm256_min_ps(
+        _mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+        _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_set1_ps(range.max)));
+
+    _mm256_storeu_ps(dist, tmin);
+    int mask = _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LT_OQ));
+#else
+    int mask = slab_test_sse(node, 0, ray, inv_dir, range, dist)
+             | slab_test_sse(node, 4, ray, inv_dir, range, dist);
+#endif
+    return mask & ((1 << node.child_count) - 1);
+}
+#endif // __SSE__
+
+template <int Width>
+WideBVH<Width>::WideBVH(const BVH_Node &root) : aabb(root.aabb), depth(0) {
+    if (root.is_leaf() && root.prims.empty()) {
+        // Nothing to intersect
+        return;
+    }
+    collapse(root, 1);
+}
+
+template <int Width>
+uint32_t WideBVH<Width>::collapse(const BVH_Node &node, int node_depth) {
+    uint32_t index = nodes.size();
+    nodes.emplace_back();
+    depth = std::max(depth, node_depth);
+
+    const BVH_Node *children[Width];
+    int count = 0;
+    if (node.is_leaf()) {
+        children[count++] = &node;
+    } else {
+        children[count++] = node.left.get();
+        children[count++] = node.right.get();
+    }
+
+    // Pull up grandchildren by opening the inner child with the largest
+    // surface area until the node is full.
+    while (count < Width) {
+        int largest = -1;
+        float largest_area = -1;
+        for (int i = 0; i < count; ++i) {
+            float area = children[i]->aabb.surface_area();
+            if (!children[i]->is_leaf() && area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        const BVH_Node *open = children[largest];
+        children[largest] = open->left.get();
+        children[count++] = open->right.get();
+    }
+
+    BVH_WideNode<Width> wide;
+    wide.child_count = count;
+    for (int i = 0; i < Width; ++i) {
+        // Unused slots get empty bounds, but the slab test would accept
+        // them. intersect_children masks them out with child_count.
+        const Aabb &box = i < count ? children[i]->aabb : Aabb::empty();
+        wide.min_x[i] = box.min_bounds.x;
+        wide.min_y[i] = box.min_bounds.y;
+        wide.min_z[i] = box.min_bounds.z;
+        wide.max_x[i] = box.max_bounds.x;
+        wide.max_y[i] = box.max_bounds.y;
+        wide.max_z[i] = box.max_bounds.z;
+        wide.child[i] = 0;
+        wide.prim_count[i] = 0;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        const BVH_Node *child = children[i];
+        if (child->is_leaf()) {
+            wide.child[i] = prims.size() | BVH_WideNode<Width>::LeafFlag;
+            wide.prim_count[i] = child->prims.size();
+            prims.insert(prims.end(), child->prims.begin(), child->prims.end());
+        } else {
+            wide.child[i] = collapse(*child, node_depth + 1);
+        }
+    }
+    nodes[index] = wide;
+    return index;
+}
+
+template <int Width>
+void WideBVH<Width>::refit() {
+    if (!nodes.empty()) {
+        aabb = refit_node(0);
+    }
+}
+
+// Refits the children of a node and returns the bounds of the node
+template <int Width>
+Aabb WideBVH<Width>::refit_node(uint32_t index) {
+    Aabb bounds = Aabb::empty();
+    for (int i = 0; i < nodes[index].child_count; ++i) {
+        const auto &node = nodes[index];
+        Aabb child_box = Aabb::empty();
+
+        if (node.child[i] & BVH_WideNode<Width>::LeafFlag) {
+            uint32_t first = node.child[i] & ~BVH_WideNode<Width>::LeafFlag;
+            for (uint32_t p = 0; p < node.prim_count[i]; ++p) {
+                Aabb box;
+                if (prims[first + p]->bounding_box(box)) {
+                    child_box = Aabb::enclose(child_box, box);
+                }
+            }
+        } else {
+            child_box = refit_node(node.child[i]);
+        }
+
+        auto &wide = nodes[index];
+        wide.min_x[i] = child_box.min_bounds.x;
+        wide.min_y[i] = child_box.min_bounds.y;
+        wide.min_z[i] = child_box.min_bounds.z;
+        wide.max_x[i] = child_box.max_bounds.x;
+        wide.max_y[i] = child_box.max_bounds.y;
+        wide.max_z[i] = child_box.max_bounds.z;
+        bounds = Aabb::enclose(bounds, child_box);
+    }
+    return bounds;
+}
+
+template <int Width>
+bool WideBVH<Width>::bounding_box(Aabb &box) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    box = aabb;
+    return true;
+}
+
+// Walks the nodes of a wide BVH hit by a ray. Closest hit walks push the
+// children hit far to near so the nearest is popped first and skip those
+// behind a closer hit, any hit walks push them unsorted. leaf(first,
+// count, range) intersects the entities of a leaf and may shrink
+// range.max, returning true ends the walk.
+template <bool AnyHit, int Width, int StackSize, typename Node, typename LeafFn>
+static void traverse_wide(const std::vector<Node> &nodes, int depth,
+                          const Ray &ray, Range range, LeafFn leaf)
+{
+    struct StackEntry {
+        uint32_t child;
+        uint32_t prim_count;
+        float dist;
+    };
+
+    if (nodes.empty()) {
+        return;
+    }
+    Vec3 inv_dir(1.0f / ray.direction.x,
+                 1.0f / ray.direction.y,
+                 1.0f / ray.direction.z);
+
+    StackEntry local_stack[StackSize];
+    std::vector<StackEntry> heap_stack;
+    StackEntry *stack = local_stack;
+    int max_stack = depth * (Width - 1) + 1;
+    if (max_stack > StackSize) {
+        heap_stack.resize(max_stack);
+        stack = heap_stack.data();
+    }
+
+    int sp = 0;
+    stack[sp++] = StackEntry{0, 0, range.min};
+
+    while (sp > 0) {
+        StackEntry entry = stack[--sp];
+        if (!AnyHit && entry.dist >= range.max) {
+            // Closer hit found since this child was pushed
+            continue;
+        }
+        if (entry.child & Node::LeafFlag) {
+            if (leaf(entry.child & ~Node::LeafFlag, entry.prim_count, range)) {
+                return;
+            }
+            continue;
+        }
+
+        const auto &node = nodes[entry.child];
+        float dist[Width];
+        int mask = intersect_children(node, ray, inv_dir, range, dist);
+        if (AnyHit) {
+            for (int i = 0; i < node.child_count; ++i) {
+                if (mask & (1 << i)) {
+                    stack[sp++] = StackEntry{node.child[i], node.prim_count[i], dist[i]};
+                }
+            }
+            continue;
+        }
+
+        int order[Width];
+        int hits = 0;
+        for (int i = 0; i < node.child_count; ++i) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            int j = hits++;
+            while (j > 0 && dist[order[j-1]] < dist[i]) {
+                order[j] = order[j-1];
+                --j;
+            }
+            order[j] = i;
+        }
+        for (int j = 0; j < hits; ++j) {
+            int i = order[j];
+            stack[sp++] = StackEntry{node.child[i], node.prim_count[i], dist[i]};
+        }
+    }
+}
+
+template <int Width>
+bool WideBVH<Width>::ray_intersect(const Ray &ray,
+                                   Range range,
+                                   Hit &hit) const
+{
+    bool any_hit = false;
+    traverse_wide<false, Width, StackSize>(nodes, depth, ray, range,
+        [&](uint32_t first, uint32_t count, Range &range) {
+            for (uint32_t i = 0; i < count; ++i) {
+                if (prims[first + i]->ray_intersect(ray, range, hit)) {
+                    range.max = hit.dist;
+                    any_hit = true;
+                }
+            }
+            return false;
+        });
+    return any_hit;
+}
+
+template <int Width>
+bool WideBVH<Width>::occluded(const Ray &ray, Range range) const {
+    bool blocked = false;
+    traverse_wide<true, Width, StackSize>(nodes, depth, ray, range,
+        [&](uint32_t first, uint32_t count, Range &range) {
+            for (uint32_t i = 0; i < count; ++i) {
+                if (prims[first + i]->occluded(ray, range)) {
+                    blocked = true;
+                    return true;
+                }
+            }
+            return false;
+        });
+    return blocked;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+
+// Picks the power of two grid spacing so 255 steps from origin cover max
+inline int quantize_exponent(float origin, float max) {
+    float extent = max - origin;
+    int e = extent > 0 ? static_cast<int>(ceilf(log2f(extent / 255.0f))) : -100;
+    e = std::max(e, -100);
+    while (e < 127 && origin + 255.0f * ldexpf(1.0f, e) < max) {
+        ++e;
+    }
+    return e;
+}
+
+// Quantizes child bounds on one axis, rounding outwards
+inline void quantize_bounds(float origin, float scale,
+                            float min, float max,
+                            uint8_t &q_min, uint8_t &q_max)
+{
+    int lo = static_cast<int>(floorf((min - origin) / scale));
+    int hi = static_cast<int>(ceilf((max - origin) / scale));
+    lo = std::min(std::max(lo, 0), 255);
+    hi = std::min(std::max(hi, 0), 255);
+
+    // Decoded bounds must not be rounded inwards
+    while (lo > 0 && origin + float(lo) * scale > min) --lo;
+    while (hi < 255 && origin + float(hi) * scale < max) ++hi;
+
+    q_min = lo;
+    q_max = hi;
+}
+
+CompressedBVH::CompressedBVH(const BVH4 &bvh)
+    : prims(bvh.prims), aabb(bvh.aabb), depth(bvh.depth)
+{
+    nodes.resize(bvh.nodes.size());
+    for (size_t n = 0; n < bvh.nodes.size(); ++n) {
+        const auto &wide = bvh.nodes[n];
+        auto &node = nodes[n];
+
+        Aabb box = Aabb::empty();
+        for (int i = 0; i < wide.child_count; ++i) {
+            box = Aabb::enclose(box, Aabb(
+                Vec3(wide.min_x[i], wide.min_y[i], wide.min_z[i]),
+                Vec3(wide.max_x[i], wide.max_y[i], wide.max_z[i])));
+        }
+
+        float scale[3];
+        for (int a = 0; a < 3; ++a) {
+            node.origin[a] = box.min_bounds[a];
+            node.exponent[a] = quantize_exponent(box.min_bounds[a],
+                                                 box.max_bounds[a]);
+            scale[a] = ldexpf(1.0f, node.exponent[a]);
+        }
+        node.child_count = wide.child_count;
+
+        for (int i = 0; i < 4; ++i) {
+            node.child[i] = wide.child[i];
+            node.prim_count[i] = wide.prim_count[i];
+            if (i >= wide.child_count) {
+                // Unused, masked out by child_count in intersect_children
+                node.q_min_x[i] = node.q_min_y[i] = node.q_min_z[i] = 255;
+                node.q_max_x[i] = node.q_max_y[i] = node.q_max_z[i] = 0;
+                continue;
+            }
+            quantize_bounds(node.origin[0], scale[0],
+                            wide.min_x[i], wide.max_x[i],
+                            node.q_min_x[i], node.q_max_x[i]);
+            quantize_bounds(node.origin[1], scale[1],
+                            wide.min_y[i], wide.max_y[i],
+                            node.q_min_y[i], node.q_max_y[i]);
+            quantize_bounds(node.origin[2], scale[2],
+                            wide.min_z[i], wide.max_z[i],
+                            node.q_min_z[i], node.q_max_z[i]);
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// Decodes 4 quantized bounds
+inline __m128 dequantize4(const uint8_t *q, __m128 origin, __m128 scale) {
+    int32_t bytes;
+    memcpy(&bytes, q, sizeof(bytes));
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_cvtsi32_si128(bytes);
+    v = _mm_unpacklo_epi8(v, zero);
+    v = _mm_unpacklo_epi16(v, zero);
+    return _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), scale), origin);
+}
+#endif
+
+// Slab test against the decoded child bounds of a quantized node
+static int intersect_children(const BVH_QuantizedNode &node,
+                              const Ray &ray, const Vec3 &inv_dir,
+                              Range range, float *dist)
+{
+#if defined(__SSE2__)
+    __m128 ox = _mm_set1_ps(node.origin[0]);
+    __m128 oy = _mm_set1_ps(node.origin[1]);
+    __m128 oz = _mm_set1_ps(node.origin[2]);
+    __m128 sx = _mm_set1_ps(ldexpf(1.0f, node.exponent[0]));
+    __m128 sy = _mm_set1_ps(ldexpf(1.0f, node.exponent[1]));
+    __m128 sz = _mm_set1_ps(ldexpf(1.0f, node.exponent[2]));
+
+    int mask = slab_test4(dequantize4(node.q_min_x, ox, sx),
+                          dequantize4(node.q_min_y, oy, sy),
+                          dequantize4(node.q_min_z, oz, sz),
+                          dequantize4(node.q_max_x, ox, sx),
+                          dequantize4(node.q_max_y, oy, sy),
+                          dequantize4(node.q_max_z, oz, sz),
+                          ray, inv_dir, range, dist);
+    return mask & ((1 << node.child_count) - 1);
+#else
+    BVH_WideNode<4> wide;
+    wide.child_count = node.child_count;
+    for (int i = 0; i < 4; ++i) {
+        float sx = ldexpf(1.0f, node.exponent[0]);
+        float sy = ldexpf(1.0f, node.exponent[1]);
+        float sz = ldexpf(1.0f, node.exponent[2]);
+        wide.min_x[i] = node.origin[0] + float(node.q_min_x[i]) * sx;
+        wide.min_y[i] = node.origin[1] + float(node.q_min_y[i]) * sy;
+        wide.min_z[i] = node.origin[2] + float(node.q_min_z[i]) * sz;
+        wide.max_x[i] = node.origin[0] + float(node.q_max_x[i]) * sx;
+        wide.max_y[i] = node.origin[1] + float(node.q_max_y[i]) * sy;
+        wide.max_z[i] = node.origin[2] + float(node.q_max_z[i]) * sz;
+    }
+    return intersect_children(wide, ray, inv_dir, range, dist);
+#endif
+}
+
+bool CompressedBVH::bounding_box(Aabb &box) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    box = aabb;
+    return true;
+}
+
+bool CompressedBVH::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
+    bool any_hit = false;
+    traverse_wide<false, 4, StackSize>(nodes, depth, ray, range,
+        [&](uint32_t first, uint32_t count, Range &range) {
+            for (uint32_t i = 0; i < count; ++i) {
+                if (prims[first + i]->ray_intersect(ray, range, hit)) {
+                    range.max = hit.dist;
+                    any_hit = true;
+                }
+            }
+            return false;
+        });
+    return any_hit;
+}
+
+bool CompressedBVH::occluded(const Ray &ray, Range range) const {
+    bool blocked = false;
+    traverse_wide<true, 4, StackSize>(nodes, depth, ray, range,
+        [&](uint32_t first, uint32_t count, Range &range) {
+            for (uint32_t i = 0; i < count; ++i) {
+                if (prims[first + i]->occluded(ray, range)) {
+                    blocked = true;
+                    return true;
+                }
+            }
+            return false;
+        });
+    return blocked;
+}
+
+} // ne
@@ -0,0 +1,580 @@
+#ifndef NE_BVH_H
+#define NE_BVH_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <unordered_set>
+
+#include "entity.h"
+#include "aabb.h"
+#include "ray.h"
+
+namespace ne {
+
+struct BVH_Stats {
+    // Wall clock time spent building the tree
+    double build_ms = 0;
+
+    int nodes = 0;
+    int leaves = 0;
+};
+
+enum class BVH_Build {
+    // Binned surface area heuristic, slower to build but produces trees
+    // that are faster to traverse.
+    SAH,
+
+    // Linear BVH from primitives sorted by the Morton code of their
+    // centroid. Builds in linear time, for previews and scenes that
+    // change every frame.
+    Morton,
+
+    // SAH build that also considers splitting space instead of objects,
+    // references to entities on both sides of a split plane are clipped
+    // and duplicated into both children. Produces less overlap between
+    // nodes in scenes with large or long, thin primitives.
+    Spatial,
+};
+
+struct BVH_Options {
+    BVH_Build build = BVH_Build::SAH;
+
+    // Number of buckets entity centroids are sorted into when searching
+    // for the split with the lowest surface area heuristic (SAH) cost.
+    // At most 64 bins are used.
+    int bins = 16;
+
+    // Nodes with this many entities or fewer may become leaves. Clamped
+    // to 65535, the most a flat node can count.
+    int max_leaf_size = 4;
+
+    // Relative cost of visiting a node and of intersecting an entity
+    float traversal_cost = 1.0f;
+    float intersect_cost = 1.0f;
+
+    // Spatial splits are only tried when the children of an object split
+    // overlap by more than this fraction of the root surface area.
+    float spatial_alpha = 0.00001f;
+
+    // Spatial splits may add at most this many references per entity
+    float max_duplication = 0.3f;
+
+    // TriangleBVH leaves store their triangles as TriangleBlocks with
+    // precomputed edges instead of gathering them from the vertex and
+    // index buffers at every test. Faster to intersect, but takes about
+    // twice the memory of the indexed mesh.
+    bool triangle_blocks = true;
+
+    // Number of threads subtrees are built on
+    int threads = 1;
+
+    // If set, build statistics are written here
+    BVH_Stats *stats = nullptr;
+};
+
+// Bounding Volume Hierarchies
+class BVH_Node : public Entity {
+public:
+    // Children of an inner node, both are null for leaves
+    std::shared_ptr<BVH_Node> left;
+    std::shared_ptr<BVH_Node> right;
+
+    // Entities contained in a leaf node
+    std::vector<std::shared_ptr<Entity>> prims;
+    Aabb aabb;
+
+    BVH_Node() {}
+
+    BVH_Node(World &world, const BVH_Options &options = BVH_Options())
+        : BVH_Node(world.entities, 0, world.entities.size(), options) {}
+
+    BVH_Node(std::vector<std::shared_ptr<Entity>> &entities,
+             size_t start, size_t end,
+             const BVH_Options &options = BVH_Options());
+
+    inline bool is_leaf() const;
+
+    // Expected cost of intersecting a random ray with the hierarchy,
+    // lower is better. Used to compare the quality of different trees.
+    float sah_cost(const BVH_Options &options = BVH_Options()) const;
+
+    // Recomputes the bounds of every node from the current bounds of the
+    // entities without changing the topology of the tree. For animated
+    // scenes where entities move but are not added or removed.
+    void refit();
+
+    virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
+    virtual bool bounding_box(Aabb &box) const;
+
+    ~BVH_Node() {}
+};
+
+// Appends the entities in the leaves of a tree to prims. Spatial splits
+// may list an entity in several leaves.
+void collect_prims(const BVH_Node &node,
+                   std::vector<std::shared_ptr<Entity>> &prims);
+
+// Walks the entities below entity as they are placed in the world, for
+// passes that flatten a scene such as compiling a Scene or collecting
+// lights. Worlds and BVH_Node trees are replaced by their entities, each
+// visited once, Move and RotateY wrappers are folded into transform and
+// every Flip toggles flip. leaf(entity, transform, flip) is called for
+// anything else.
+template <typename LeafFn>
+void walk_placed(const std::shared_ptr<Entity> &entity,
+                 const Transform &transform, bool flip,
+                 LeafFn &leaf);
+
+// Node of a LinearBVH, 32 bytes so two nodes share a cache line.
+struct BVH_LinearNode {
+    Aabb aabb;
+
+    // Leaf nodes: index of the first entity in LinearBVH::prims.
+    // Inner nodes: index of the second child, the first child is always
+    // stored directly after its parent.
+    uint32_t offset;
+
+    // Number of entities in a leaf, 0 for inner nodes
+    uint16_t prim_count;
+
+    // Axis the children are separated on, used to visit the nearest
+    // child first.
+    uint8_t axis;
+    uint8_t pad;
+};
+
+static_assert(sizeof(BVH_LinearNode) == 32, "BVH_LinearNode must be 32 bytes");
+
+// Compiled form of a BVH_Node tree. Nodes are stored depth first in a
+// contiguous array and traversed with an explicit stack, avoiding the
+// pointer chasing and virtual calls of the BVH_Node tree.
+class LinearBVH : public Entity {
+public:
+    static const int StackSize = 64;
+
+    std::vector<BVH_LinearNode> nodes;
+    std::vector<std::shared_ptr<Entity>> prims;
+
+    // Depth of the deepest leaf
+    int depth;
+
+    // SAH cost of the tree when it was built
+    float built_cost;
+
+    LinearBVH() : depth(0), built_cost(0) {}
+    LinearBVH(const BVH_Node &root);
+    LinearBVH(World &world, const BVH_Options &options = BVH_Options())
+        : LinearBVH(BVH_Node(world, options)) {}
+
+    // See BVH_Node::sah_cost
+    float sah_cost(const BVH_Options &options = BVH_Options()) const;
+
+    // See BVH_Node::refit. Entities that are BVHs themselves must be
+    // refit before the BVHs containing them.
+    void refit();
+
+    // Refitting keeps the topology of the tree, which gets worse as the
+    // entities move away from where they were when it was built. Returns
+    // true once the SAH cost grew by more than max_cost_ratio since the
+    // build and a full rebuild would pay off.
+    inline bool needs_rebuild(float max_cost_ratio = 1.5f) const;
+
+    virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
+
+    // Traverses the tree once for all lanes, testing each node against
+    // every lane with SSE. Lanes whose directions point into different
+    // octants would disagree on the near child and are traced on their
+    // own instead.
+    virtual int intersect_packet(RayPacket &packet, int mask, Hit *hits) const;
+
+    virtual bool bounding_box(Aabb &box) const;
+
+    ~LinearBVH() {}
+
+private:
+    uint32_t flatten(const BVH_Node &node, int node_depth);
+};
+
+// 4 triangles in SoA layout with their edges, tested against a ray
+// at once with SSE. Unused lanes hold degenerate triangles that are never
+// hit.
+struct alignas(16) TriangleBlock {
+    static const int Size = 4;
+
+    float v0_x[Size], v0_y[Size], v0_z[Size];
+
+    // v1 - v0 and v2 - v0
+    float e1_x[Size], e1_y[Size], e1_z[Size];
+    float e2_x[Size], e2_y[Size], e2_z[Size];
+
+    inline void set(int lane, const Vec3 &v0, const Vec3 &v1, const Vec3 &v2);
+};
+
+// BVH over an indexed triangle mesh. The mesh is kept as one vertex
+// buffer and one index buffer instead of Triangle entities, and leaf
+// triangles are gathered into TriangleBlocks as they are tested. With
+// BVH_Options::triangle_blocks the leaves keep blocks with precomputed
+// edges instead. The normal and uv are only computed for the closest
+// triangle. Hits do not have a material set.
+class TriangleBVH {
+public:
+    // Leaf nodes: offset is the index of the first triangle, prim_count
+    // the number of triangles.
+    std::vector<BVH_LinearNode> nodes;
+
+    std::vector<Vec3> vertices;
+
+    // 3 indices into vertices per triangle, ordered so the triangles of
+    // each leaf are contiguous. Spatial splits may repeat a triangle in
+    // several leaves.
+    std::vector<uint32_t> indices;
+
+    // Used instead of the vertex and index buffers, which are then empty,
+    // when built with BVH_Options::triangle_blocks. Triangle i is lane
+    // i % 4 of block i / 4, each leaf starts a new block.
+    std::vector<TriangleBlock> blocks;
+
+    // Depth of the deepest leaf
+    int depth;
+
+    TriangleBVH() : depth(0) {}
+    TriangleBVH(const std::vector<Vec3> &vertecies,
+                const std::vector<uint32_t> &indices,
+                const BVH_Options &options = BVH_Options());
+
+    bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    bool occluded(const Ray &ray, Range range) const;
+    int intersect_packet(RayPacket &packet, int mask, Hit *hits) const;
+
+    // Block of up to TriangleBlock::Size triangles of a leaf from first.
+    // Without precomputed blocks they are gathered into temp.
+    inline const TriangleBlock &block(uint32_t first, uint32_t count,
+                                      TriangleBlock &temp) const;
+};
+
+// Many spheres in one entity, for particle and point cloud scenes. Centers
+// and radii are stored in SoA arrays sorted into the leaves of an internal
+// BVH, and each leaf is tested 8 spheres at a time with AVX (or two SSE
+// tests without AVX support). The uv is only computed for the closest
+// hit. A max_leaf_size of 8 fills every lane.
+class SphereSet : public Entity {
+public:
+    static const int Width = 8;
+
+    // Leaf nodes: offset is the index of the first sphere, prim_count the
+    // number of spheres.
+    std::vector<BVH_LinearNode> nodes;
+
+    // Padded with Width unused spheres so a full block can always be loaded
+    std::vector<float> x, y, z, radius;
+    std::vector<Material *> materials;
+
+    // Depth of the deepest leaf
+    int depth;
+
+    SphereSet() : depth(0) {}
+    SphereSet(const std::vector<Sphere> &spheres,
+              const BVH_Options &options = BVH_Options());
+
+    virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
+    virtual int intersect_packet(RayPacket &packet, int mask, Hit *hits) const;
+    virtual bool bounding_box(Aabb &box) const;
+
+    ~SphereSet() {}
+};
+
+// Primitive types stored in the typed arrays of a Scene. Entity is any
+// other entity, intersected through its virtual methods.
+enum class PrimType : uint8_t {
+    Sphere,
+    Triangle,
+    Quad,
+    Box,
+    PlacedBox,
+    Entity,
+};
+
+// Reference from a Scene leaf to a primitive, the index is into the array
+// of its type.
+struct PrimRef {
+    uint32_t index;
+    PrimType type;
+
+    // Swaps the front and back face of hits, set for primitives that were
+    // wrapped in a Flip.
+    bool flip;
+};
+
+struct SceneSphere {
+    Vec3 center;
+    float radius;
+    Material *material;
+};
+
+struct SceneTriangle {
+    Vec3 v0;
+
+    // v1 - v0 and v2 - v0
+    Vec3 e1, e2;
+    Material *material;
+};
+
+// Axis aligned rectangle in the plane axis = k. u is the first and v the
+// second of the other two axes, as in PlaneXY, PlaneXZ and PlaneYZ.
+struct SceneQuad {
+    float k;
+    float u0, u1, v0, v1;
+    int axis;
+    Material *material;
+};
+
+struct SceneBox {
+    Vec3 box_min;
+    Vec3 box_max;
+    Material *material;
+};
+
+// Box placed by a transform such as a rotation. The bounds are in the
+// space of the box, and rays are moved into it with to_local.
+struct ScenePlacedBox {
+    SceneBox box;
+    Transform to_local;
+};
+
+// Compiled form of a World. Spheres, triangles, planes and boxes are
+// copied into contiguous arrays of their type and leaves refer to them by
+// type and index, so leaf tests are a switch on the type instead of a
+// virtual call, and are inlined. The primitives of a leaf are sorted by
+// type, and each array is in leaf order. Hit attributes are only computed
+// for the closest hit. The entity classes remain the way scenes are
+// described, other entities are kept and called as before.
+//
+// Building also flattens the scene: nested worlds and BVH_Node trees are
+// replaced by their entities, and chains of Move, RotateY and Flip are
+// folded into the primitives below them. Boxes that are not only moved
+// keep the combined transform in their own array, so plain boxes stay
+// small. Any other primitive that would not stay the same type in world
+// space is placed by a single Instance. The scene is a snapshot,
+// later changes to the world or its wrappers need a new Scene.
+class Scene : public Entity {
+public:
+    std::vector<BVH_LinearNode> nodes;
+    std::vector<PrimRef> prims;
+
+    std::vector<SceneSphere> spheres;
+    std::vector<SceneTriangle> triangles;
+    std::vector<SceneQuad> quads;
+    std::vector<SceneBox> boxes;
+    std::vector<ScenePlacedBox> placed_boxes;
+    std::vector<std::shared_ptr<Entity>> entities;
+
+    // Depth of the deepest leaf
+    int depth;
+
+    Scene() : depth(0) {}
+
+    Scene(World &world, const BVH_Options &options = BVH_Options());
+
+    virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
+    virtual int intersect_packet(RayPacket &packet, int mask, Hit *hits) const;
+    virtual bool bounding_box(Aabb &box) const;
+
+    ~Scene() {}
+};
+
+// Node of a WideBVH with up to Width children. Child bounds are stored
+// in SoA layout so all children are tested against a ray at once.
+template <int Width>
+struct alignas(32) BVH_WideNode {
+    static const uint32_t LeafFlag = 0x80000000;
+
+    float min_x[Width], min_y[Width], min_z[Width];
+    float max_x[Width], max_y[Width], max_z[Width];
+
+    // Index of an inner child node, or the index of the first entity of
+    // a leaf child with LeafFlag set.
+    uint32_t child[Width];
+
+    // Number of entities in a leaf child, 0 for inner children
+    uint16_t prim_count[Width];
+
+    int child_count;
+};
+
+// BVH with 4 or 8 children per node, collapsed from a binary BVH_Node
+// tree. Each node tests all of its child boxes with one SSE (BVH4) or
+// AVX (BVH8) slab test and visits the hit children nearest first.
+// Without AVX support BVH8 falls back to two SSE tests.
+template <int Width>
+class WideBVH : public Entity {
+public:
+    static const int StackSize = 256;
+
+    std::vector<BVH_WideNode<Width>> nodes;
+    std::vector<std::shared_ptr<Entity>> prims;
+    Aabb aabb;
+
+    // Depth of the deepest node
+    int depth;
+
+    WideBVH() : depth(0) {}
+    WideBVH(const BVH_Node &root);
+    WideBVH(World &world, const BVH_Options &options = BVH_Options())
+        : WideBVH(BVH_Node(world, options)) {}
+
+    // See BVH_Node::refit
+    void refit();
+
+    virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
+    virtual bool bounding_box(Aabb &box) const;
+
+    ~WideBVH() {}
+
+private:
+    uint32_t collapse(const BVH_Node &node, int node_depth);
+    Aabb refit_node(uint32_t index);
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
+
+// Node of a CompressedBVH, one 64 byte cache line for 4 children. Child
+// bounds are stored as 8 bit offsets on a grid spanning the node bounds:
+// bound = origin + q * 2^exponent.
+struct alignas(64) BVH_QuantizedNode {
+    static const uint32_t LeafFlag = 0x80000000;
+
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t child_count;
+
+    uint8_t q_min_x[4], q_min_y[4], q_min_z[4];
+    uint8_t q_max_x[4], q_max_y[4], q_max_z[4];
+
+    // See BVH_WideNode
+    uint32_t child[4];
+    uint16_t prim_count[4];
+};
+
+static_assert(sizeof(BVH_QuantizedNode) == 64,
+              "BVH_QuantizedNode must be 64 bytes");
+
+// BVH4 with quantized child bounds. Nodes are half the size of BVH4 nodes,
+// at the cost of decoding child bounds during traversal. Quantized bounds
+// are rounded outwards so they always enclose the exact bounds.
+class CompressedBVH : public Entity {
+public:
+    static const int StackSize = 256;
+
+    std::vector<BVH_QuantizedNode> nodes;
+    std::vector<std::shared_ptr<Entity>> prims;
+    Aabb aabb;
+
+    // Depth of the deepest node
+    int depth;
+
+    CompressedBVH() : depth(0) {}
+    CompressedBVH(const BVH4 &bvh);
+    CompressedBVH(const BVH_Node &root) : CompressedBVH(BVH4(root)) {}
+    CompressedBVH(World &world, const BVH_Options &options = BVH_Options())
+        : CompressedBVH(BVH4(world, options)) {}
+
+    virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
+    virtual bool bounding_box(Aabb &box) const;
+
+    ~CompressedBVH() {}
+};
+
+inline bool BVH_Node::is_leaf() const {
+    return left == nullptr;
+}
+
+inline void TriangleBlock::set(int lane,
+                               const Vec3 &v0,
+                               const Vec3 &v1,
+                               const Vec3 &v2)
+{
+    v0_x[lane] = v0.x;
+    v0_y[lane] = v0.y;
+    v0_z[lane] = v0.z;
+    e1_x[lane] = v1.x - v0.x;
+    e1_y[lane] = v1.y - v0.y;
+    e1_z[lane] = v1.z - v0.z;
+    e2_x[lane] = v2.x - v0.x;
+    e2_y[lane] = v2.y - v0.y;
+    e2_z[lane] = v2.z - v0.z;
+}
+
+template <typename LeafFn>
+void walk_placed(const std::shared_ptr<Entity> &entity,
+                 const Transform &transform, bool flip,
+                 LeafFn &leaf)
+{
+    const Entity *e = entity.get();
+    if (auto world = dynamic_cast<const World *>(e)) {
+        for (const auto &child : world->entities) {
+            walk_placed(child, transform, flip, leaf);
+        }
+        return;
+    }
+    if (auto node = dynamic_cast<const BVH_Node *>(e)) {
+        std::vector<std::shared_ptr<Entity>> prims;
+        collect_prims(*node, prims);
+
+        // Spatial splits reference entities from several leaves
+        std::unordered_set<const Entity *> seen;
+        for (const auto &prim : prims) {
+            if (seen.insert(prim.get()).second) {
+                walk_placed(prim, transform, flip, leaf);
+            }
+        }
+        return;
+    }
+    if (auto move = dynamic_cast<const Move *>(e)) {
+        walk_placed(move->entity,
+                    transform * Transform::translate(move->offset),
+                    flip, leaf);
+        return;
+    }
+    if (auto rotate = dynamic_cast<const RotateY *>(e)) {
+        walk_placed(rotate->entity, transform * rotate->transform(), flip, leaf);
+        return;
+    }
+    if (auto f = dynamic_cast<const Flip *>(e)) {
+        walk_placed(f->e, transform, !flip, leaf);
+        return;
+    }
+    leaf(entity, transform, flip);
+}
+
+inline const TriangleBlock &TriangleBVH::block(uint32_t first,
+                                               uint32_t count,
+                                               TriangleBlock &temp) const
+{
+    if (!blocks.empty()) {
+        return blocks[first / TriangleBlock::Size];
+    }
+    for (uint32_t lane = 0; lane < count; ++lane) {
+        const uint32_t *tri = &indices[3 * (first + lane)];
+        temp.set(lane, vertices[tri[0]], vertices[tri[1]], vertices[tri[2]]);
+    }
+    for (uint32_t lane = count; lane < TriangleBlock::Size; ++lane) {
+        temp.set(lane, Vec3::zero, Vec3::zero, Vec3::zero);
+    }
+    return temp;
+}
+
+inline bool LinearBVH::needs_rebuild(float max_cost_ratio) const {
+    return sah_cost() > built_cost * max_cost_ratio;
+}
+
+} // ne
+
+#endif // NE_BVH_H
@@ -3,6 +3,7 @@
 
 #include "vec.h"
 #include "ray.h"
+#include "sampler.h"
 
 namespace ne {
 
@@ -17,7 +18,9 @@ public:
         float aperture,
         float focus_dist);
 
-    inline Ray ray_from_view(float u, float v) const;
+    // Ray through view coordinates (u, v), lens is a sample in [0,1)^2
+    // for the point on the lens
+    inline Ray ray_from_view(float u, float v, const Vec3 &lens) const;
 
 private:
     Vec3 position;
@@ -28,8 +31,8 @@ private:
     float lens_radius;
 };
 
-inline Ray Camera::ray_from_view(float s, float t) const {
-    Vec3 r = lens_radius * Vec3::random_in_unit_circle();
+inline Ray Camera::ray_from_view(float s, float t, const Vec3 &lens) const {
+    Vec3 r = lens_radius * sample_disk(lens);
     Vec3 offset = u*r.x + v*r.y;
     return Ray{
         position + offset,
@@ -1,21 +1,49 @@
 #include <cmath>
 #include <algorithm>
+#include <unordered_set>
 
 #include "entity.h"
+#include "bvh.h"
+#include "material.h"
 #include "vec.h"
 #include "ray.h"
 #include "aabb.h"
 
 namespace ne {
 
-inline void face_normal(const Ray &ray, Hit &hit) {
-    if (Vec3::dot(ray.direction, hit.normal) >= 0) {
-        // Invert normals if they are inside the entity
-        hit.normal = -hit.normal;
-        hit.face = Hit::Back_Face;
-    } else {
-        hit.face = Hit::Front_Face;
+void Entity::split_box(const Aabb &box, int axis, float position,
+                       Aabb &left, Aabb &right) const
+{
+    left = right = box;
+    left.max_bounds.a[axis] = fminf(box.max_bounds[axis], position);
+    right.min_bounds.a[axis] = fmaxf(box.min_bounds[axis], position);
+}
+
+bool Entity::occluded(const Ray &ray, Range range) const {
+    Hit hit;
+    return ray_intersect(ray, range, hit);
+}
+
+int Entity::intersect_packet(RayPacket &packet, int mask, Hit *hits) const {
+    int hit_mask = 0;
+    for (int i = 0; i < RayPacket::Size; ++i) {
+        if (!(mask & (1 << i))) {
+            continue;
+        }
+        if (ray_intersect(packet.rays[i], packet.range(i), hits[i])) {
+            packet.max_dist[i] = hits[i].dist;
+            hit_mask |= 1 << i;
+        }
     }
+    return hit_mask;
+}
+
+float Entity::pdf_value(const Vec3 &origin, const Vec3 &direction) const {
+    return 0;
+}
+
+Vec3 Entity::random(const Vec3 &origin, const Vec3 &u) const {
+    return Vec3(1, 0, 0);
 }
 
 Vec3 sphere_uv(const Vec3 &p) {
@@ -58,17 +86,70 @@ bool Sphere::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     return true;
 }
 
+bool Sphere::occluded(const Ray &ray, Range range) const {
+    Vec3 oc = ray.origin - position;
+    float a = ray.direction.length_sqr();
+    float half_b = Vec3::dot(oc, ray.direction);
+    float c = oc.length_sqr() - radius*radius;
+    float discriminant = half_b*half_b - a*c;
+
+    if (discriminant <= 0) {
+        return false;
+    }
+
+    float root = sqrtf(discriminant);
+    float near = (-half_b - root) / a;
+    float far = (-half_b + root) / a;
+    return (near < range.max && near > range.min)
+        || (far < range.max && far > range.min);
+}
+
 bool Sphere::bounding_box(Aabb &box) const {
     box = Aabb(position - radius*Vec3::one, position + radius*Vec3::one);
     return true;
 }
 
-bool Triangle::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
+float Sphere::pdf_value(const Vec3 &origin, const Vec3 &direction) const {
+    // Only whether the direction hits matters, occluded skips the hit
+    // attributes and the uv
+    if (!occluded(Ray(origin, direction), Range(MinDist, Infinity))) {
+        return 0;
+    }
+    float dist_sqr = (position - origin).length_sqr();
+    if (dist_sqr <= radius*radius) {
+        // Not sampled from inside
+        return 0;
+    }
+    float cos_theta_max = sqrtf(1.0f - radius*radius / dist_sqr);
+    return 1.0f / (2.0f*PI*(1.0f - cos_theta_max));
+}
+
+Vec3 Sphere::random(const Vec3 &origin, const Vec3 &u) const {
+    // Uniform direction in the cone the sphere covers
+    Vec3 w = position - origin;
+    float dist_sqr = w.length_sqr();
+    w = w.normalized();
+    float cos_theta_max = sqrtf(fmaxf(0.0f, 1.0f - radius*radius / dist_sqr));
+    float z = 1.0f + u.y*(cos_theta_max - 1.0f);
+    float r = sqrtf(fmaxf(0.0f, 1.0f - z*z));
+    float phi = 2.0f*PI*u.x;
+
+    Vec3 t, v;
+    Vec3::basis(w, t, v);
+    return t*(r*cosf(phi)) + v*(r*sinf(phi)) + w*z;
+}
+
+// Intersects a ray with the plane of a triangle and tests the hit point
+// against its edges. Writes the unit normal, the distance and the
+// barycentric coordinates of the hit.
+static bool intersect_triangle(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2,
+                               const Ray &ray, Range range,
+                               Vec3 &norm, float &dist, float &u, float &v)
+{
     // Plane normal
     Vec3 edge1 = v1 - v0;
     Vec3 edge2 = v2 - v0;
-    Vec3 norm = Vec3::cross(edge1, edge2).normalized();
-    float det = norm.length_sqr();
+    norm = Vec3::cross(edge1, edge2).normalized();
 
     float dir = Vec3::dot(norm, ray.direction);
     if (fabsf(Vec3::dot(norm, ray.direction)) < Epsilon) {
@@ -77,7 +158,7 @@ bool Triangle::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     }
 
     float d = Vec3::dot(norm, v0);
-    float dist = (Vec3::dot(norm, ray.origin)-d) / -dir;
+    dist = (Vec3::dot(norm, ray.origin)-d) / -dir;
     if (dist < range.min || dist > range.max) {
         return false;
     }
@@ -90,14 +171,25 @@ bool Triangle::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
 
     Vec3 e1 = v2 - v1;
     Vec3 vp1 = p - v1;
-    float u = Vec3::dot(norm, Vec3::cross(e1, vp1));
+    u = Vec3::dot(norm, Vec3::cross(e1, vp1));
     if (u < 0) return false;
 
     Vec3 e2 = v0 - v2;
     Vec3 vp2 = p - v2;
-    float v = Vec3::dot(norm, Vec3::cross(e2, vp2));
+    v = Vec3::dot(norm, Vec3::cross(e2, vp2));
     if (v < 0) return false;
 
+    return true;
+}
+
+bool Triangle::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
+    Vec3 norm;
+    float dist, u, v;
+    if (!intersect_triangle(v0, v1, v2, ray, range, norm, dist, u, v)) {
+        return false;
+    }
+    float det = norm.length_sqr();
+
     hit.material = material;
     hit.position = ray.at(dist);
     hit.normal = norm;
@@ -107,48 +199,140 @@ bool Triangle::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     return true;
 }
 
+bool Triangle::occluded(const Ray &ray, Range range) const {
+    Vec3 norm;
+    float dist, u, v;
+    return intersect_triangle(v0, v1, v2, ray, range, norm, dist, u, v);
+}
+
 bool Triangle::bounding_box(Aabb &box) const {
-    return false;
+    Vec3 min(fminf(v0.x, fminf(v1.x, v2.x)),
+             fminf(v0.y, fminf(v1.y, v2.y)),
+             fminf(v0.z, fminf(v1.z, v2.z)));
+    Vec3 max(fmaxf(v0.x, fmaxf(v1.x, v2.x)),
+             fmaxf(v0.y, fmaxf(v1.y, v2.y)),
+             fmaxf(v0.z, fmaxf(v1.z, v2.z)));
+
+    // Axis aligned triangles are flat on one axis, pad the box the same
+    // way as planes so it has a non-zero width.
+    for (int a = 0; a < 3; ++a) {
+        if (max[a] - min[a] < 0.0001f) {
+            min.a[a] -= 0.0001f;
+            max.a[a] += 0.0001f;
+        }
+    }
+    box = Aabb(min, max);
+    return true;
 }
 
-Mesh::Mesh(const std::vector<Vec3> &vertecies, Material *material) {
-    tris.reserve(vertecies.size() / 3);
-    for (int i = 0; i < vertecies.size(); i += 3) {
-        Vec3 v0 = vertecies[i + 0];
-        Vec3 v1 = vertecies[i + 1];
-        Vec3 v2 = vertecies[i + 2];
-        tris.push_back(std::make_shared<Triangle>(v0, v1, v2, material));
+void Triangle::split_box(const Aabb &box, int axis, float position,
+                         Aabb &left, Aabb &right) const
+{
+    // Bounds of the vertices and edge crossings on each side of the plane
+    Aabb l = Aabb::empty();
+    Aabb r = Aabb::empty();
+    const Vec3 *v[3] = {&v0, &v1, &v2};
+
+    for (int i = 0; i < 3; ++i) {
+        const Vec3 &a = *v[i];
+        const Vec3 &b = *v[(i + 1) % 3];
+        float da = a[axis] - position;
+        float db = b[axis] - position;
+
+        if (da <= 0) l = Aabb::enclose(l, a);
+        if (da >= 0) r = Aabb::enclose(r, a);
+
+        if ((da < 0 && db > 0) || (da > 0 && db < 0)) {
+            Vec3 p = Vec3::lerp(a, b, da / (da - db));
+            p.a[axis] = position;
+            l = Aabb::enclose(l, p);
+            r = Aabb::enclose(r, p);
+        }
     }
-    Vec3 min = Vec3::one * Infinity;
-    Vec3 max = Vec3::one * -Infinity;
-    for (const auto &v : vertecies) {
-        for (int a = 0; a < 3; ++a) {
-            if (v[a] < min[a]) {
-                min.a[a] = v[a];
-            }
-            if (v[a] > max[a]) {
-                max.a[a] = v[a];
+
+    // Keep flat halves padded the same way as the triangle bounds
+    for (int a = 0; a < 3; ++a) {
+        for (Aabb *half : {&l, &r}) {
+            float width = half->max_bounds[a] - half->min_bounds[a];
+            if (width >= 0 && width < 0.0001f) {
+                half->min_bounds.a[a] -= 0.0001f;
+                half->max_bounds.a[a] += 0.0001f;
             }
         }
     }
-    aabb = Aabb(min, max);
+
+    // The triangle may already be clipped by box
+    Entity::split_box(box, axis, position, left, right);
+    for (int a = 0; a < 3; ++a) {
+        left.min_bounds.a[a] = fmaxf(left.min_bounds[a], l.min_bounds[a]);
+        left.max_bounds.a[a] = fminf(left.max_bounds[a], l.max_bounds[a]);
+        right.min_bounds.a[a] = fmaxf(right.min_bounds[a], r.min_bounds[a]);
+        right.max_bounds.a[a] = fminf(right.max_bounds[a], r.max_bounds[a]);
+    }
+}
+
+Mesh::Mesh()
+    : material(nullptr),
+      bvh(std::make_shared<TriangleBVH>()) {}
+
+Mesh::Mesh(const std::vector<Vec3> &vertecies, Material *material)
+    : Mesh(vertecies, material, BVH_Options()) {}
+
+Mesh::Mesh(const std::vector<Vec3> &vertecies,
+           Material *material,
+           const BVH_Options &options)
+    : Mesh(vertecies, std::vector<uint32_t>(), material, options) {}
+
+Mesh::Mesh(const std::vector<Vec3> &vertecies,
+           const std::vector<uint32_t> &indices,
+           Material *material,
+           const BVH_Options &options)
+    : material(material)
+{
+    // A triangle list without indices
+    std::vector<uint32_t> list;
+    if (indices.empty()) {
+        list.resize(vertecies.size() - vertecies.size() % 3);
+        for (size_t i = 0; i < list.size(); ++i) {
+            list[i] = i;
+        }
+    }
+    const auto &tris = indices.empty() ? list : indices;
+    bvh = std::make_shared<TriangleBVH>(vertecies, tris, options);
+
+    aabb = Aabb::empty();
+    for (uint32_t index : tris) {
+        aabb = Aabb::enclose(aabb, vertecies[index]);
+    }
 }
 
 bool Mesh::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
-    Hit current_hit;
-    bool any_hit = false;
+    if (!bvh->ray_intersect(ray, range, hit)) {
+        return false;
+    }
+    hit.material = material;
+    return true;
+}
 
-    for (const auto &tri : tris) {
-        if (tri->ray_intersect(ray, range, current_hit)) {
-            range.max = current_hit.dist;
-            hit = current_hit;
-            any_hit = true;
+bool Mesh::occluded(const Ray &ray, Range range) const {
+    return bvh->occluded(ray, range);
+}
+
+int Mesh::intersect_packet(RayPacket &packet, int mask, Hit *hits) const {
+    int hit_mask = bvh->intersect_packet(packet, mask, hits);
+    for (int i = 0; i < RayPacket::Size; ++i) {
+        if (hit_mask & (1 << i)) {
+            hits[i].material = material;
         }
     }
-    return any_hit;
+    return hit_mask;
 }
 
 bool Mesh::bounding_box(Aabb &box) const {
+    if (bvh->nodes.empty()) {
+        // No triangles
+        return false;
+    }
     box = aabb;
     return true;
 }
@@ -174,6 +358,16 @@ bool PlaneXY::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     return true;
 }
 
+bool PlaneXY::occluded(const Ray &ray, Range range) const {
+    float dist = (z-ray.origin.z) / ray.direction.z;
+    if (dist < range.min || dist > range.max) {
+        return false;
+    }
+    float x = ray.origin.x + dist*ray.direction.x;
+    float y = ray.origin.y + dist*ray.direction.y;
+    return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+}
+
 bool PlaneXY::bounding_box(Aabb &box) const {
     // Bounding box must have non-zero width, and planes are infinitely
     // thin on one axis so the box is padded.
@@ -181,6 +375,34 @@ bool PlaneXY::bounding_box(Aabb &box) const {
     return true;
 }
 
+// Solid angle pdf of a direction to a point picked uniformly on a plane
+// perpendicular to axis
+static float plane_pdf(const Entity &plane, int axis, float area,
+                       const Vec3 &origin, const Vec3 &direction)
+{
+    // Directions along the plane never reach it, the distance to it would
+    // be 0/0
+    if (fabsf(direction[axis]) <= Epsilon * direction.length()) {
+        return 0;
+    }
+    Hit hit;
+    if (!plane.ray_intersect(Ray(origin, direction), Range(MinDist, Infinity), hit)) {
+        return 0;
+    }
+    float dist_sqr = hit.dist*hit.dist * direction.length_sqr();
+    float cosine = fabsf(Vec3::dot(direction, hit.normal)) / direction.length();
+    return dist_sqr / (cosine * area);
+}
+
+float PlaneXY::pdf_value(const Vec3 &origin, const Vec3 &direction) const {
+    return plane_pdf(*this, 2, (x1 - x0)*(y1 - y0), origin, direction);
+}
+
+Vec3 PlaneXY::random(const Vec3 &origin, const Vec3 &u) const {
+    Vec3 p(x0 + u.x*(x1 - x0), y0 + u.y*(y1 - y0), z);
+    return p - origin;
+}
+
 bool PlaneXZ::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     float dist = (y-ray.origin.y) / ray.direction.y;
     if (dist < range.min || dist > range.max) {
@@ -202,11 +424,30 @@ bool PlaneXZ::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     return true;
 }
 
+bool PlaneXZ::occluded(const Ray &ray, Range range) const {
+    float dist = (y-ray.origin.y) / ray.direction.y;
+    if (dist < range.min || dist > range.max) {
+        return false;
+    }
+    float x = ray.origin.x + dist*ray.direction.x;
+    float z = ray.origin.z + dist*ray.direction.z;
+    return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+}
+
 bool PlaneXZ::bounding_box(Aabb &box) const {
     box = Aabb(Vec3(x0, y-0.0001f, z0), Vec3(x1, y+0.0001f, z1));
     return true;
 }
 
+float PlaneXZ::pdf_value(const Vec3 &origin, const Vec3 &direction) const {
+    return plane_pdf(*this, 1, (x1 - x0)*(z1 - z0), origin, direction);
+}
+
+Vec3 PlaneXZ::random(const Vec3 &origin, const Vec3 &u) const {
+    Vec3 p(x0 + u.x*(x1 - x0), y, z0 + u.y*(z1 - z0));
+    return p - origin;
+}
+
 bool PlaneYZ::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     float dist = (x-ray.origin.x) / ray.direction.x;
     if (dist < range.min || dist > range.max) {
@@ -227,11 +468,30 @@ bool PlaneYZ::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     return true;
 }
 
+bool PlaneYZ::occluded(const Ray &ray, Range range) const {
+    float dist = (x-ray.origin.x) / ray.direction.x;
+    if (dist < range.min || dist > range.max) {
+        return false;
+    }
+    float y = ray.origin.y + dist*ray.direction.y;
+    float z = ray.origin.z + dist*ray.direction.z;
+    return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+}
+
 bool PlaneYZ::bounding_box(Aabb &box) const {
     box = Aabb(Vec3(x-0.0001f, y0, z0), Vec3(x+0.0001f, y1, z1));
     return true;
 }
 
+float PlaneYZ::pdf_value(const Vec3 &origin, const Vec3 &direction) const {
+    return plane_pdf(*this, 0, (y1 - y0)*(z1 - z0), origin, direction);
+}
+
+Vec3 PlaneYZ::random(const Vec3 &origin, const Vec3 &u) const {
+    Vec3 p(x, y0 + u.x*(y1 - y0), z0 + u.y*(z1 - z0));
+    return p - origin;
+}
+
 bool Flip::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     if (!e->ray_intersect(ray, range, hit)) {
         return false;
@@ -243,10 +503,22 @@ bool Flip::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     return true;
 }
 
+bool Flip::occluded(const Ray &ray, Range range) const {
+    return e->occluded(ray, range);
+}
+
 bool Flip::bounding_box(Aabb &box) const {
     return e->bounding_box(box);
 }
 
+float Flip::pdf_value(const Vec3 &origin, const Vec3 &direction) const {
+    return e->pdf_value(origin, direction);
+}
+
+Vec3 Flip::random(const Vec3 &origin, const Vec3 &u) const {
+    return e->random(origin, u);
+}
+
 bool World::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     Hit current_hit;
     bool any_hit = false;
@@ -261,12 +533,29 @@ bool World::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     return any_hit;
 }
 
+bool World::occluded(const Ray &ray, Range range) const {
+    for (const auto &entity : entities) {
+        if (entity->occluded(ray, range)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int World::intersect_packet(RayPacket &packet, int mask, Hit *hits) const {
+    int hit_mask = 0;
+    for (const auto &entity : entities) {
+        hit_mask |= entity->intersect_packet(packet, mask, hits);
+    }
+    return hit_mask;
+}
+
 bool World::bounding_box(Aabb &box) const {
     if (entities.empty()) {
         return false;
     }
     Aabb temp_box;
-    bool first_box;
+    bool first_box = true;
 
     for (const auto &entity : entities) {
         if (!entity->bounding_box(temp_box)) {
@@ -278,95 +567,234 @@ bool World::bounding_box(Aabb &box) const {
     return true;
 }
 
-BVH_Node::BVH_Node(std::vector<std::shared_ptr<Entity>> &entities,
-                   size_t start, size_t end)
-{
-    int axis = random_int(0, 2);
-    auto box_compare = [=](const std::shared_ptr<Entity> &a,
-                           const std::shared_ptr<Entity> &b)
-    {
-        Aabb box_a;
-        Aabb box_b;
-
-        if (!a->bounding_box(box_a) || !b->bounding_box(box_b)) {
-            printf("[error] BVH_Node without bounding box\n");
-        }
-        return box_a.min_bounds[axis] < box_b.min_bounds[axis];
-    };
+float World::pdf_value(const Vec3 &origin, const Vec3 &direction) const {
+    if (entities.empty()) {
+        return 0;
+    }
+    float sum = 0;
+    for (const auto &entity : entities) {
+        sum += entity->pdf_value(origin, direction);
+    }
+    return sum / entities.size();
+}
 
-    size_t entity_span = end - start;
-    switch (entity_span) {
-    case 1:
-        left = right = entities[start];
-        break;
-    case 2:
-        if (box_compare(entities[start], entities[start+1])) {
-            left = entities[start];
-            right = entities[start+1];
-        } else {
-            left = entities[start+1];
-            right = entities[start];
-        }
-        break;
-    default:
-        std::sort(entities.begin() + start,
-                  entities.begin() + end,
-                  box_compare);
-        size_t mid = start + entity_span / 2;
-        left = std::make_shared<BVH_Node>(entities, start, mid);
-        right = std::make_shared<BVH_Node>(entities, mid, end);
-        break;
+Vec3 World::random(const Vec3 &origin, const Vec3 &u) const {
+    if (entities.empty()) {
+        return Vec3(1, 0, 0);
     }
+    // u.x picks the entity, what is left of it is the sample for it
+    float x = u.x * entities.size();
+    size_t i = std::min(size_t(x), entities.size() - 1);
+    return entities[i]->random(origin, Vec3(x - i, u.y, 0));
+}
 
-    Aabb box_left;
-    Aabb box_right;
-    if (!left->bounding_box(box_left)
-        || !right->bounding_box(box_right))
-    {
-        printf("[error] BVH_Node without bounding box\n");
+// Material of an emissive sphere or plane, the entities that can be
+// sampled as lights. Null for anything else.
+static Material *light_material(const Entity *entity) {
+    Material *material = nullptr;
+    if (auto sphere = dynamic_cast<const Sphere *>(entity)) {
+        material = sphere->material;
+    } else if (auto plane = dynamic_cast<const PlaneXY *>(entity)) {
+        material = plane->material;
+    } else if (auto plane = dynamic_cast<const PlaneXZ *>(entity)) {
+        material = plane->material;
+    } else if (auto plane = dynamic_cast<const PlaneYZ *>(entity)) {
+        material = plane->material;
     }
-    // Bounding box of this node encloses the boxes of its children
-    aabb = Aabb::enclose(box_left, box_right);
+    return material && material->emissive() ? material : nullptr;
 }
 
-bool BVH_Node::bounding_box(Aabb &box) const {
-    box = aabb;
+// Transforms that only rotate and move keep solid angles
+static bool is_rigid(const Transform &t) {
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            float dot = t.m[0][i]*t.m[0][j] + t.m[1][i]*t.m[1][j]
+                      + t.m[2][i]*t.m[2][j];
+            if (fabsf(dot - (i == j ? 1.0f : 0.0f)) > 1e-4f) {
+                return false;
+            }
+        }
+    }
     return true;
 }
 
-bool BVH_Node::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
-    if (!aabb.intersect(ray, range.min, range.max)) {
-        return false;
+static void collect_entity(const std::shared_ptr<Entity> &entity,
+                           const Transform &transform,
+                           World &lights);
+
+// Spatial split BVHs reference entities from several leaves
+static void collect_unique(const std::vector<std::shared_ptr<Entity>> &prims,
+                           const Transform &transform,
+                           World &lights)
+{
+    std::unordered_set<const Entity *> seen;
+    for (const auto &prim : prims) {
+        if (seen.insert(prim.get()).second) {
+            collect_entity(prim, transform, lights);
+        }
     }
-    bool hit_left = left->ray_intersect(ray, range, hit);
-    range.max = hit_left ? hit.dist : range.max;
-    bool hit_right = right->ray_intersect(ray, range, hit);
+}
 
-    return hit_left || hit_right;
+// True if the typed arrays of a scene hold spheres or planes that would
+// be lights in a World
+static bool scene_has_lights(const Scene &scene) {
+    for (const auto &sphere : scene.spheres) {
+        if (sphere.material && sphere.material->emissive()) {
+            return true;
+        }
+    }
+    for (const auto &quad : scene.quads) {
+        if (quad.material && quad.material->emissive()) {
+            return true;
+        }
+    }
+    return false;
 }
 
-Box::Box(const Vec3 &p0, const Vec3 &p1, Material *m) {
-    box_min = p0;
-    box_max = p1;
+// Adds entity to lights if it is a light, placed by transform. The
+// wrappers and trees walk_placed does not flatten are searched here.
+static void collect_placed(const std::shared_ptr<Entity> &entity,
+                           const Transform &transform,
+                           World &lights)
+{
+    const Entity *e = entity.get();
+    if (auto bvh = dynamic_cast<const LinearBVH *>(e)) {
+        collect_unique(bvh->prims, transform, lights);
+        return;
+    }
+    if (auto bvh = dynamic_cast<const BVH4 *>(e)) {
+        collect_unique(bvh->prims, transform, lights);
+        return;
+    }
+    if (auto bvh = dynamic_cast<const BVH8 *>(e)) {
+        collect_unique(bvh->prims, transform, lights);
+        return;
+    }
+    if (auto bvh = dynamic_cast<const CompressedBVH *>(e)) {
+        collect_unique(bvh->prims, transform, lights);
+        return;
+    }
+    if (auto scene = dynamic_cast<const Scene *>(e)) {
+        if (scene_has_lights(*scene)) {
+            printf("[warning] Lights compiled into a Scene are not sampled\n");
+        }
+        collect_unique(scene->entities, transform, lights);
+        return;
+    }
+    if (auto instance = dynamic_cast<const Instance *>(e)) {
+        collect_entity(instance->entity, transform * instance->transform, lights);
+        return;
+    }
 
-    // Front and back
-    sides.add(std::make_shared<PlaneXY>(p0.x, p1.x, p0.y, p1.y, p1.z, m));
-    sides.add(std::make_shared<Flip>(
-        std::make_shared<PlaneXY>(p0.x, p1.x, p0.y, p1.y, p0.z, m)));
+    Material *material = light_material(e);
+    if (!material) {
+        return;
+    }
+    if (transform.is_identity()) {
+        lights.add(entity);
+    } else if (is_rigid(transform)) {
+        lights.add(std::make_shared<Instance>(entity, transform));
+    } else {
+        printf("[warning] Scaled lights are not sampled\n");
+    }
+}
 
-    // Top and bottom
-    sides.add(std::make_shared<PlaneXZ>(p0.x, p1.x, p0.z, p1.z, p1.y, m));
-    sides.add(std::make_shared<Flip>(
-        std::make_shared<PlaneXZ>(p0.x, p1.x, p0.z, p1.z, p0.y, m)));
+// Adds the lights below entity to lights
+static void collect_entity(const std::shared_ptr<Entity> &entity,
+                           const Transform &transform,
+                           World &lights)
+{
+    auto collect = [&](const std::shared_ptr<Entity> &placed,
+                       const Transform &placed_transform, bool) {
+        collect_placed(placed, placed_transform, lights);
+    };
+    walk_placed(entity, transform, false, collect);
+}
+
+void collect_lights(const World &world, World &lights) {
+    for (const auto &entity : world.entities) {
+        collect_entity(entity, Transform(), lights);
+    }
+}
 
-    // Left and right
-    sides.add(std::make_shared<PlaneYZ>(p0.y, p1.y, p0.z, p1.z, p1.x, m));
-    sides.add(std::make_shared<Flip>(
-        std::make_shared<PlaneYZ>(p0.y, p1.y, p0.z, p1.z, p0.x, m)));
+Box::Box(const Vec3 &p0, const Vec3 &p1, Material *m)
+    : box_min(p0), box_max(p1), material(m) {}
+
+// Slab test returning the distances and axes of the faces where the ray
+// enters and leaves the box.
+inline bool box_slabs(const Vec3 &box_min, const Vec3 &box_max,
+                      const Ray &ray,
+                      float &t_near, int &near_axis,
+                      float &t_far, int &far_axis)
+{
+    t_near = -Infinity;
+    t_far = Infinity;
+    near_axis = far_axis = 0;
+    for (int a = 0; a < 3; ++a) {
+        float inv_dir = 1.0f / ray.direction[a];
+        float t0 = (box_min[a] - ray.origin[a]) * inv_dir;
+        float t1 = (box_max[a] - ray.origin[a]) * inv_dir;
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        if (t0 > t_near) {
+            t_near = t0;
+            near_axis = a;
+        }
+        if (t1 < t_far) {
+            t_far = t1;
+            far_axis = a;
+        }
+    }
+    return t_near <= t_far;
 }
 
 bool Box::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
-    return sides.ray_intersect(ray, range, hit);
+    float t_near, t_far;
+    int near_axis, far_axis;
+    if (!box_slabs(box_min, box_max, ray, t_near, near_axis, t_far, far_axis)) {
+        return false;
+    }
+
+    // The ray enters through the min face of an axis if it travels
+    // towards +axis, and leaves through the max face.
+    float dist;
+    int axis;
+    bool max_face;
+    if (t_near >= range.min && t_near <= range.max) {
+        dist = t_near;
+        axis = near_axis;
+        max_face = ray.direction[axis] < 0;
+    } else if (t_far >= range.min && t_far <= range.max) {
+        dist = t_far;
+        axis = far_axis;
+        max_face = ray.direction[axis] >= 0;
+    } else {
+        return false;
+    }
+
+    Vec3 p = ray.at(dist);
+    int u_axis = axis == 0 ? 1 : 0;
+    int v_axis = axis == 2 ? 1 : 2;
+    hit.uv.x = (p[u_axis] - box_min[u_axis]) / (box_max[u_axis] - box_min[u_axis]);
+    hit.uv.y = (p[v_axis] - box_min[v_axis]) / (box_max[v_axis] - box_min[v_axis]);
+    hit.dist = dist;
+    hit.normal = Vec3();
+    hit.normal.a[axis] = max_face ? 1.0f : -1.0f;
+    hit.material = material;
+    hit.position = p;
+    face_normal(ray, hit);
+    return true;
+}
+
+bool Box::occluded(const Ray &ray, Range range) const {
+    float t_near, t_far;
+    int near_axis, far_axis;
+    if (!box_slabs(box_min, box_max, ray, t_near, near_axis, t_far, far_axis)) {
+        return false;
+    }
+    return (t_near >= range.min && t_near <= range.max)
+        || (t_far >= range.min && t_far <= range.max);
 }
 
 bool Box::bounding_box(Aabb &box) const {
@@ -379,11 +807,17 @@ bool Move::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     if (!entity->ray_intersect(moved, range, hit)) {
         return false;
     }
+    // The normal already faces against the ray, computing the face again
+    // would make every hit a front face.
     hit.position = hit.position + offset;
-    face_normal(ray, hit);
     return true;
 }
 
+bool Move::occluded(const Ray &ray, Range range) const {
+    Ray moved(ray.origin - offset, ray.direction);
+    return entity->occluded(moved, range);
+}
+
 bool Move::bounding_box(Aabb &box) const {
     if (!entity->bounding_box(box)) {
         return false;
@@ -392,7 +826,19 @@ bool Move::bounding_box(Aabb &box) const {
     return true;
 }
 
+float Move::pdf_value(const Vec3 &origin, const Vec3 &direction) const {
+    return entity->pdf_value(origin - offset, direction);
+}
+
+Vec3 Move::random(const Vec3 &origin, const Vec3 &u) const {
+    return entity->random(origin - offset, u);
+}
+
 RotateY::RotateY(std::shared_ptr<Entity> e, float angle) : entity(e) {
+    set_angle(angle);
+}
+
+void RotateY::set_angle(float angle) {
     float rad = radians(angle);
     sin_theta = sinf(rad);
     cos_theta = cosf(rad);
@@ -442,17 +888,80 @@ bool RotateY::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
     position.x = cos_theta*hit.position.x + sin_theta*hit.position.z;
     position.z = -sin_theta*hit.position.x + cos_theta*hit.position.z;
     normal.x = cos_theta*hit.normal.x + sin_theta*hit.normal.z;
-    normal.z = -cos_theta*hit.normal.x + cos_theta*hit.normal.z;
+    normal.z = -sin_theta*hit.normal.x + cos_theta*hit.normal.z;
 
+    // Rotating both the ray and the normal keeps the normal facing against
+    // the ray, so hit.face is still valid.
     hit.position = position;
     hit.normal = normal;
-    face_normal(rot, hit);
     return true;
 }
 
+bool RotateY::occluded(const Ray &ray, Range range) const {
+    Vec3 origin = ray.origin;
+    Vec3 direction = ray.direction;
+
+    origin.x = cos_theta*ray.origin.x - sin_theta*ray.origin.z;
+    origin.z = sin_theta*ray.origin.x + cos_theta*ray.origin.z;
+    direction.x = cos_theta*ray.direction.x - sin_theta*ray.direction.z;
+    direction.z = sin_theta*ray.direction.x + cos_theta*ray.direction.z;
+
+    return entity->occluded(Ray(origin, direction), range);
+}
+
 bool RotateY::bounding_box(Aabb &box) const {
     box = aabb;
     return has_box;
 }
 
+Instance::Instance(std::shared_ptr<Entity> e, const Transform &transform)
+    : entity(e)
+{
+    set_transform(transform);
+}
+
+void Instance::set_transform(const Transform &t) {
+    transform = t;
+    inv_transform = t.inverse();
+    has_box = entity->bounding_box(aabb);
+    if (has_box) {
+        aabb = transform.box(aabb);
+    }
+}
+
+bool Instance::ray_intersect(const Ray &ray, Range range, Hit &hit) const {
+    // The direction is not normalized, so distances along the ray are the
+    // same in object and world space.
+    Ray local(inv_transform.point(ray.origin),
+              inv_transform.vector(ray.direction));
+    if (!entity->ray_intersect(local, range, hit)) {
+        return false;
+    }
+    // Affine transforms keep the side of the surface the ray hits, so
+    // hit.face is still valid.
+    hit.position = ray.at(hit.dist);
+    hit.normal = inv_transform.normal(hit.normal).normalized();
+    return true;
+}
+
+bool Instance::occluded(const Ray &ray, Range range) const {
+    Ray local(inv_transform.point(ray.origin),
+              inv_transform.vector(ray.direction));
+    return entity->occluded(local, range);
+}
+
+bool Instance::bounding_box(Aabb &box) const {
+    box = aabb;
+    return has_box;
+}
+
+float Instance::pdf_value(const Vec3 &origin, const Vec3 &direction) const {
+    return entity->pdf_value(inv_transform.point(origin),
+                             inv_transform.vector(direction));
+}
+
+Vec3 Instance::random(const Vec3 &origin, const Vec3 &u) const {
+    return transform.vector(entity->random(inv_transform.point(origin), u));
+}
+
 } // ne
@@ -9,10 +9,13 @@
 #include "material.h"
 #include "vec.h"
 #include "aabb.h"
+#include "transform.h"
 
 namespace ne {
 
 class Material;
+class TriangleBVH;
+struct BVH_Options;
 
 struct Hit {
     enum Face { Front_Face, Back_Face };
@@ -25,6 +28,21 @@ struct Hit {
     Material *material;
 };
 
+// Flips the normal of a hit to face against the ray and records which
+// side of the surface was hit.
+inline void face_normal(const Ray &ray, Hit &hit) {
+    if (Vec3::dot(ray.direction, hit.normal) >= 0) {
+        // Invert normals if they are inside the entity
+        hit.normal = -hit.normal;
+        hit.face = Hit::Back_Face;
+    } else {
+        hit.face = Hit::Front_Face;
+    }
+}
+
+// uv coordinates of a point on the unit sphere
+Vec3 sphere_uv(const Vec3 &p);
+
 class Entity {
 public:
     virtual bool ray_intersect(
@@ -34,6 +52,31 @@ public:
 
     virtual bool bounding_box(Aabb &box) const = 0;
 
+    // Returns true if the ray hits anything within range. Stops at the
+    // first hit and computes no hit attributes, for shadow rays and other
+    // visibility tests. By default falls back to ray_intersect.
+    virtual bool occluded(const Ray &ray, Range range) const;
+
+    // Intersects the lanes of a packet set in mask. Closer hits are
+    // written to hits and shrink the range of their lane, returns the
+    // mask of lanes hit. By default each lane is traced on its own.
+    virtual int intersect_packet(RayPacket &packet, int mask, Hit *hits) const;
+
+    // Splits the part of the entity inside box at a plane on an axis and
+    // returns the bounds of both halves. Used by spatial split BVH builds,
+    // by default the box itself is split.
+    virtual void split_box(const Aabb &box, int axis, float position,
+                           Aabb &left, Aabb &right) const;
+
+    // Probability density over solid angle of random returning direction
+    // from origin. Entities that cannot be sampled return 0, by default
+    // none can. Used to sample lights.
+    virtual float pdf_value(const Vec3 &origin, const Vec3 &direction) const;
+
+    // Direction from origin to a random point on the entity, u is a
+    // sample in [0,1)^2
+    virtual Vec3 random(const Vec3 &origin, const Vec3 &u) const;
+
     virtual ~Entity() {};
 };
 
@@ -47,7 +90,10 @@ public:
         : v0(v0), v1(v1), v2(v2), material(material) {}
 
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
     virtual bool bounding_box(Aabb &box) const;
+    virtual void split_box(const Aabb &box, int axis, float position,
+                           Aabb &left, Aabb &right) const;
 
     ~Triangle() {}
 };
@@ -55,12 +101,29 @@ public:
 class Mesh : public Entity {
 public:
     Aabb aabb;
-    std::vector<std::shared_ptr<Triangle>> tris;
+    Material *material;
+
+    // Vertex and index buffers of the mesh and a BVH over its triangles
+    std::shared_ptr<TriangleBVH> bvh;
+
+    // Empty mesh without triangles
+    Mesh();
 
-    Mesh() {}
+    // Every 3 vertices form a triangle
     Mesh(const std::vector<Vec3> &vertecies, Material *material);
+    Mesh(const std::vector<Vec3> &vertecies,
+         Material *material,
+         const BVH_Options &options);
+
+    // Indexed mesh, 3 indices into vertecies per triangle
+    Mesh(const std::vector<Vec3> &vertecies,
+         const std::vector<uint32_t> &indices,
+         Material *material,
+         const BVH_Options &options);
 
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
+    virtual int intersect_packet(RayPacket &packet, int mask, Hit *hits) const;
     virtual bool bounding_box(Aabb &box) const;
 
     ~Mesh() {}
@@ -77,7 +140,10 @@ public:
         : position(position), radius(radius), material(material) {}
 
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
     virtual bool bounding_box(Aabb &box) const;
+    virtual float pdf_value(const Vec3 &origin, const Vec3 &direction) const;
+    virtual Vec3 random(const Vec3 &origin, const Vec3 &u) const;
 
     ~Sphere() {}
 };
@@ -91,7 +157,10 @@ public:
         : x0(x0), x1(x1), y0(y0), y1(y1), z(z), material(m) {}
 
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
     virtual bool bounding_box(Aabb &box) const;
+    virtual float pdf_value(const Vec3 &origin, const Vec3 &direction) const;
+    virtual Vec3 random(const Vec3 &origin, const Vec3 &u) const;
 
     ~PlaneXY() {}
 };
@@ -105,7 +174,10 @@ public:
         : x0(x0), x1(x1), z0(z0), z1(z1), y(y), material(m) {}
 
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
     virtual bool bounding_box(Aabb &box) const;
+    virtual float pdf_value(const Vec3 &origin, const Vec3 &direction) const;
+    virtual Vec3 random(const Vec3 &origin, const Vec3 &u) const;
 
     ~PlaneXZ() {}
 };
@@ -119,7 +191,10 @@ public:
         : y0(y0), y1(y1), z0(z0), z1(z1), x(x), material(m) {}
 
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
     virtual bool bounding_box(Aabb &box) const;
+    virtual float pdf_value(const Vec3 &origin, const Vec3 &direction) const;
+    virtual Vec3 random(const Vec3 &origin, const Vec3 &u) const;
 
     ~PlaneYZ() {}
 };
@@ -131,7 +206,10 @@ public:
     Flip(std::shared_ptr<Entity> e) : e(e) {}
 
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
     virtual bool bounding_box(Aabb &box) const;
+    virtual float pdf_value(const Vec3 &origin, const Vec3 &direction) const;
+    virtual Vec3 random(const Vec3 &origin, const Vec3 &u) const;
 
     ~Flip() {}
 };
@@ -145,7 +223,10 @@ public:
         : entity(e), offset(offset) {}
 
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
     virtual bool bounding_box(Aabb &box) const;
+    virtual float pdf_value(const Vec3 &origin, const Vec3 &direction) const;
+    virtual Vec3 random(const Vec3 &origin, const Vec3 &u) const;
 
     ~Move() {}
 };
@@ -160,47 +241,45 @@ public:
     inline void add(std::shared_ptr<Entity> entity);
 
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
+    virtual int intersect_packet(RayPacket &packet, int mask, Hit *hits) const;
     virtual bool bounding_box(Aabb &box) const;
 
+    // Picks one of the entities with equal probability, the pdf is the
+    // average of theirs
+    virtual float pdf_value(const Vec3 &origin, const Vec3 &direction) const;
+    virtual Vec3 random(const Vec3 &origin, const Vec3 &u) const;
+
     ~World() {}
 };
 
+// Axis aligned box intersected with a single slab test. Faces have the
+// same normals and uv as the planes they replace: (x, y) on the z faces,
+// (x, z) on the y faces and (y, z) on the x faces.
 class Box : public Entity {
 public:
-    World sides;
     Vec3 box_min;
     Vec3 box_max;
+    Material *material;
 
-    Box() {}
+    Box() : material(nullptr) {}
     Box(const Vec3 &p0, const Vec3 &p1, Material *m);
 
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
     virtual bool bounding_box(Aabb &box) const;
 
     ~Box() {}
 };
 
-// Bounding Volume Hierarchies
-class BVH_Node : public Entity {
-public:
-    std::shared_ptr<Entity> left;
-    std::shared_ptr<Entity> right;
-    Aabb aabb;
-
-    BVH_Node();
-
-    BVH_Node(World &world)
-        : BVH_Node(world.entities, 0, world.entities.size()) {}
-
-    BVH_Node(std::vector<std::shared_ptr<Entity>> &entities,
-             size_t start, size_t end);
-
-
-    virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
-    virtual bool bounding_box(Aabb &box) const;
-
-    ~BVH_Node() {}
-};
+// Adds the lights of world that can be sampled to lights: spheres and
+// planes with an emissive material. Nested worlds, BVHs and the Move,
+// RotateY, Flip and Instance wrappers are searched too, lights below
+// wrappers are placed by one Instance with the combined transform.
+// Scaled lights are not sampled, nor are lights compiled into a Scene,
+// collect them from the world the Scene was built from. Emitters that are
+// not collected, such as boxes and meshes, are only found by chance.
+void collect_lights(const World &world, World &lights);
 
 inline void World::clear() {
     entities.clear();
@@ -220,12 +299,61 @@ public:
 
     RotateY(std::shared_ptr<Entity> entity, float angle);
 
+    // Changes the rotation, BVHs containing this entity must be refit
+    void set_angle(float angle);
+
+    // The rotation as a Transform, for passes that fold wrappers into one
+    // transform
+    inline Transform transform() const;
+
     virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
     virtual bool bounding_box(Aabb &box) const;
 
     ~RotateY() {}
 };
 
+// Places an entity in the world with an affine transform. Any number of
+// instances can share the same entity, usually a Mesh or a BVH, so the
+// geometry is only stored once. A BVH built over instances forms the top
+// level of a two level acceleration structure.
+class Instance : public Entity {
+public:
+    std::shared_ptr<Entity> entity;
+
+    // Object to world and world to object transforms
+    Transform transform;
+    Transform inv_transform;
+
+    bool has_box;
+    Aabb aabb;
+
+    Instance(std::shared_ptr<Entity> entity, const Transform &transform);
+
+    // Moves the instance, BVHs containing it must be refit
+    void set_transform(const Transform &t);
+
+    virtual bool ray_intersect(const Ray &ray, Range range, Hit &hit) const;
+    virtual bool occluded(const Ray &ray, Range range) const;
+    virtual bool bounding_box(Aabb &box) const;
+
+    // Only valid for transforms that rotate and move, scaling changes
+    // the solid angle the entity covers
+    virtual float pdf_value(const Vec3 &origin, const Vec3 &direction) const;
+    virtual Vec3 random(const Vec3 &origin, const Vec3 &u) const;
+
+    ~Instance() {}
+};
+
+inline Transform RotateY::transform() const {
+    Transform r;
+    r.m[0][0] = cos_theta;
+    r.m[0][2] = sin_theta;
+    r.m[2][0] = -sin_theta;
+    r.m[2][2] = cos_theta;
+    return r;
+}
+
 } // ne
 
 #endif // NE_ENTITY_H
@@ -23,13 +23,16 @@ void str_split(const std::string &s, std::vector<std::string> &out, char sep) {
     }
 }
 
-std::vector<Vec3> read_obj(const std::string &filename) {
-    std::vector<Vec3> verts;
-    std::vector<Vec3> vindex;
+bool read_obj(const std::string &filename,
+              std::vector<Vec3> &vertecies,
+              std::vector<uint32_t> &indices)
+{
+    vertecies.clear();
+    indices.clear();
     std::ifstream in(filename);
 
     if (!in) {
-        return verts;
+        return false;
     }
 
     std::string line;
@@ -42,25 +45,34 @@ std::vector<Vec3> read_obj(const std::string &filename) {
         str_split(line, tokens, ' ');
 
         if (tokens[0] == "v") {
-            // Read vertex lookup
+            // Read vertex
             float x = std::stof(tokens[1]);
             float y = std::stof(tokens[2]);
             float z = std::stof(tokens[3]);
-            vindex.push_back(Vec3(x, y, z));
+            vertecies.push_back(Vec3(x, y, z));
             continue;
         }
 
         if (tokens[0] == "f") {
-            // Read face
-            str_split(tokens[1], buf, '/');
-            verts.push_back(vindex[std::stoi(buf[0])-1]);
+            // Read face, obj indices start at 1
+            for (int i = 1; i <= 3; ++i) {
+                str_split(tokens[i], buf, '/');
+                indices.push_back(std::stoi(buf[0]) - 1);
+            }
+        }
+    }
+    return true;
+}
 
-            str_split(tokens[2], buf, '/');
-            verts.push_back(vindex[std::stoi(buf[0])-1]);
+std::vector<Vec3> read_obj(const std::string &filename) {
+    std::vector<Vec3> vertecies;
+    std::vector<uint32_t> indices;
+    std::vector<Vec3> verts;
 
-            str_split(tokens[3], buf, '/');
-            verts.push_back(vindex[std::stoi(buf[0])-1]);
-        }
+    read_obj(filename, vertecies, indices);
+    verts.reserve(indices.size());
+    for (uint32_t index : indices) {
+        verts.push_back(vertecies[index]);
     }
     return verts;
 }
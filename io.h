@@ -4,6 +4,7 @@
 #include "texture.h"
 
 #include <cstddef>
+#include <cstdint>
 #include <string>
 #include <tuple>
 #include <memory>
@@ -45,6 +46,13 @@ struct BitmapDIBHeader {
 Texture *read_bmp(const std::string &filename);
 bool write_bmp(const std::string &filename, const Texture *tex);
 
+// Reads the triangles of an obj file into a vertex buffer and an index
+// buffer with 3 indices per triangle.
+bool read_obj(const std::string &filename,
+              std::vector<Vec3> &vertecies,
+              std::vector<uint32_t> &indices);
+
+// Reads the triangles of an obj file, every 3 vertices form a triangle
 std::vector<Vec3> read_obj(const std::string &filename);
 
 } // ne
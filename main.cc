@@ -4,6 +4,7 @@
 #include "material.h"
 #include "vec.h"
 #include "entity.h"
+#include "bvh.h"
 #include "ray.h"
 #include "io.h"
 #include "renderer.h"
@@ -74,7 +75,7 @@ std::unique_ptr<World> basic_scene() {
 
 std::unique_ptr<World> random_scene() {
     auto world = std::make_unique<World>();
-    World small_spheres;
+    std::vector<Sphere> small_spheres;
 
     auto ground = new Diffuse(surf_checker(), Color(0.03f, 0.01f, 0.05f));
     world->add(std::make_unique<Sphere>(Vec3(0,-1000,0), 1000, ground));
@@ -100,11 +101,13 @@ std::unique_ptr<World> random_scene() {
             } else {
                 mat = new Dielectric(1.5f);
             }
-            small_spheres.add(std::make_unique<Sphere>(center, 0.2f, mat));
+            small_spheres.push_back(Sphere(center, 0.2f, mat));
         }
     }
 
-    world->add(std::make_shared<BVH_Node>(small_spheres));
+    BVH_Options options;
+    options.max_leaf_size = SphereSet::Width;
+    world->add(std::make_shared<SphereSet>(small_spheres, options));
 
     auto mat1 = new Dielectric(1.5f);
     world->add(std::make_unique<Sphere>(Vec3(0, 1, 0), 1.0f, mat1));
@@ -157,19 +160,48 @@ std::unique_ptr<World> scene_cube() {
     return world;
 }
 
-std::unique_ptr<World> scene_mesh(const std::string &filename) {
-    auto verts = read_obj(filename);
+std::unique_ptr<World> scene_mesh(const std::string &filename,
+                                  const BVH_Options &options) {
+    std::vector<Vec3> verts;
+    std::vector<uint32_t> indices;
+    read_obj(filename, verts, indices);
     auto world = std::make_unique<World>();
     auto white = new Diffuse(surf_solid_color(), Color::White);
     auto ground = new Metal(surf_checker(), Color(0, 0, 0), 0);
 
-    world->add(std::make_shared<Mesh>(verts, white));
+    world->add(std::make_shared<Mesh>(verts, indices, white, options));
     world->add(std::make_shared<PlaneXZ>(-555, 555, -555, 555, -1, ground));
     return world;
 }
 
+// Places a single copy of a mesh on a grid of count x count instances
+std::unique_ptr<World> scene_instances(const std::string &filename,
+                                       int count,
+                                       const BVH_Options &options) {
+    std::vector<Vec3> verts;
+    std::vector<uint32_t> indices;
+    read_obj(filename, verts, indices);
+    auto world = std::make_unique<World>();
+    auto white = new Diffuse(surf_solid_color(), Color::White);
+    auto ground = new Metal(surf_checker(), Color(0, 0, 0), 0);
+    auto mesh = std::make_shared<Mesh>(verts, indices, white, options);
+
+    World instances;
+    for (int z = 0; z < count; ++z) {
+        for (int x = 0; x < count; ++x) {
+            Vec3 offset(6.0f * (x - count/2), 0, 6.0f * z);
+            auto t = Transform::translate(offset)
+                   * Transform::rotate(Vec3::Up, randomf(0, 360));
+            instances.add(std::make_shared<Instance>(mesh, t));
+        }
+    }
+    world->add(std::make_shared<LinearBVH>(instances, options));
+    world->add(std::make_shared<PlaneXZ>(-1e4f, 1e4f, -1e4f, 1e4f, -1, ground));
+    return world;
+}
+
 int main(void) {
-    srand(1018);
+    seed_random(1018, 0);
     perlin::init();
     auto tex = new Texture(720, 720);
     write_bmp("tex.bmp", tex);
@@ -185,9 +217,25 @@ int main(void) {
     Camera camera(cam_pos, cam_lookat, Vec3::Up, 40, aspect, aperture, focus);
 
     auto world = cornell_box();
-
     Renderer renderer(2000, 20, 4);
-    renderer.render_progressive(camera, world.get(), tex);
+
+    // 2000 samples per pixel on average, pixels that converge early give
+    // the rest of their samples to noisier ones
+    renderer.adaptive.enabled = true;
+
+    BVH_Stats stats;
+    BVH_Options options;
+    options.threads = renderer.threads;
+    options.stats = &stats;
+    LinearBVH scene(*world, options);
+    printf("bvh: %d nodes, %d leaves, %.2f ms\n",
+           stats.nodes, stats.leaves, stats.build_ms);
+
+    World lights;
+    collect_lights(*world, lights);
+    renderer.lights = &lights;
+
+    renderer.render_progressive(camera, &scene, tex);
 
     return 0;
 }
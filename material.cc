@@ -16,28 +16,98 @@ float schlick(float cos_theta, float ri) {
 }
 
 bool Diffuse::scatter(
-    const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out
+    const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out,
+    Sampler &sampler
 ) const {
-    Vec3 direction = hit.normal + Vec3::random_lambertian();
+    Vec3 direction = hit.normal + sample_sphere(sampler.get2d());
+    // Samples that exactly cancel the normal, which Sobol points can
+    // do, leave no direction to normalize
+    if (direction.length_sqr() < Epsilon) {
+        direction = hit.normal;
+    }
     r_out = Ray(hit.position, direction);
     attenuation = shader(v2f{hit.uv, hit.position, albedo});
     return true;
 }
 
+Color Diffuse::eval(
+    const Ray &r_in, const Hit &hit, const Vec3 &direction
+) const {
+    float cosine = Vec3::dot(hit.normal, direction);
+    if (cosine <= 0) {
+        return Color::Black;
+    }
+    return shader(v2f{hit.uv, hit.position, albedo}) * (cosine / PI);
+}
+
+float Diffuse::pdf(
+    const Ray &r_in, const Hit &hit, const Vec3 &direction
+) const {
+    return fmaxf(0.0f, Vec3::dot(hit.normal, direction)) / PI;
+}
+
 bool Metal::scatter(
-    const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out
+    const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out,
+    Sampler &sampler
 ) const {
     Vec3 reflected = Vec3::reflect(r_in.direction.normalized(), hit.normal);
-    Vec3 r = roughness * Vec3::random_in_hemisphere(hit.normal);
-    r_out = Ray(hit.position, reflected + r);
     attenuation = shader(v2f{hit.uv, hit.position, albedo});
+    if (specular()) {
+        r_out = Ray(hit.position, reflected);
+        return true;
+    }
+
+    // cos^n distributed around the mirror direction
+    Vec3 u = sampler.get2d();
+    float n = exponent();
+    float cos_alpha = powf(u.x, 1.0f / (n + 1.0f));
+    float sin_alpha = sqrtf(fmaxf(0.0f, 1.0f - cos_alpha*cos_alpha));
+    float phi = 2.0f*PI*u.y;
+    Vec3 t, b;
+    Vec3::basis(reflected, t, b);
+    Vec3 direction = t*(sin_alpha*cosf(phi)) + b*(sin_alpha*sinf(phi))
+                   + reflected*cos_alpha;
 
     // Absorb ray if it points towards the surface
-    return Vec3::dot(r_out.direction, hit.normal) > 0;
+    float cosine = Vec3::dot(direction, hit.normal);
+    if (cosine <= 0) {
+        return false;
+    }
+    r_out = Ray(hit.position, direction);
+    attenuation = attenuation * ((n + 2.0f) / (n + 1.0f) * cosine);
+    return true;
+}
+
+Color Metal::eval(
+    const Ray &r_in, const Hit &hit, const Vec3 &direction
+) const {
+    float cosine = Vec3::dot(hit.normal, direction);
+    Vec3 reflected = Vec3::reflect(r_in.direction.normalized(), hit.normal);
+    // Rounding can put the cosine above 1, which a large exponent blows up
+    float cos_alpha = fminf(Vec3::dot(reflected, direction), 1.0f);
+    if (cosine <= 0 || cos_alpha <= 0) {
+        return Color::Black;
+    }
+    float n = exponent();
+    float lobe = (n + 2.0f) / (2.0f*PI) * powf(cos_alpha, n);
+    return shader(v2f{hit.uv, hit.position, albedo}) * (lobe * cosine);
+}
+
+float Metal::pdf(
+    const Ray &r_in, const Hit &hit, const Vec3 &direction
+) const {
+    Vec3 reflected = Vec3::reflect(r_in.direction.normalized(), hit.normal);
+    float cos_alpha = fminf(Vec3::dot(reflected, direction), 1.0f);
+    if (cos_alpha <= 0) {
+        return 0;
+    }
+    float n = exponent();
+    return (n + 1.0f) / (2.0f*PI) * powf(cos_alpha, n);
 }
 
 bool Dielectric::scatter(
-    const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out
+    const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out,
+    Sampler &sampler
 ) const {
     attenuation = albedo;
     float etai_etat = hit.face == Hit::Front_Face ? 1.0f / ri : ri;
@@ -46,7 +116,8 @@ bool Dielectric::scatter(
     float cos_theta = fminf(Vec3::dot(-direction, hit.normal), 1.0f);
     float sin_theta = sqrtf(1.0f - cos_theta*cos_theta);
 
-    if (etai_etat * sin_theta > 1.0f || randomf() < schlick(cos_theta, ri)) {
+    float u = sampler.get1d();
+    if (etai_etat * sin_theta > 1.0f || u < schlick(cos_theta, ri)) {
         // Cannot refract ray
         Vec3 reflected = Vec3::reflect(direction, hit.normal);
         r_out = Ray(hit.position, reflected);
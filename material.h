@@ -6,6 +6,7 @@
 #include "entity.h"
 #include "color.h"
 #include "shader.h"
+#include "sampler.h"
 
 namespace ne {
 
@@ -16,13 +17,43 @@ public:
     Shader shader;
     Color albedo;
 
+    // Samples the direction of r_out, the random numbers come from the
+    // current sample of sampler. For materials that are not specular the
+    // attenuation is eval divided by pdf of the direction.
     virtual bool scatter(
-        const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out
+        const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out,
+        Sampler &sampler
     ) const = 0;
 
     virtual Color emitted(float u, float v, const Vec3 &p) const {
         return Color::Black;
     }
+
+    virtual bool emissive() const {
+        return false;
+    }
+
+    // Specular materials scatter in directions that cannot be evaluated,
+    // lights are not sampled from their hits
+    virtual bool specular() const {
+        return true;
+    }
+
+    // BSDF times the cosine of light scattered from the normalized
+    // direction towards the ray, for materials that are not specular
+    virtual Color eval(
+        const Ray &r_in, const Hit &hit, const Vec3 &direction
+    ) const {
+        return Color::Black;
+    }
+
+    // Probability density over solid angle of scatter picking the
+    // normalized direction, for materials that are not specular
+    virtual float pdf(
+        const Ray &r_in, const Hit &hit, const Vec3 &direction
+    ) const {
+        return 0;
+    }
 };
 
 class Diffuse : public Material {
@@ -33,24 +64,57 @@ public:
     }
 
     virtual bool scatter(
-        const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out
+        const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out,
+        Sampler &sampler
+    ) const;
+
+    virtual bool specular() const {
+        return false;
+    }
+
+    virtual Color eval(
+        const Ray &r_in, const Hit &hit, const Vec3 &direction
+    ) const;
+
+    virtual float pdf(
+        const Ray &r_in, const Hit &hit, const Vec3 &direction
     ) const;
 };
 
+// Glossy reflection with a normalized Phong lobe around the mirror
+// direction. A roughness of 0 is a perfect mirror, roughness is clamped to
+// 1 where the lobe is uniform around the mirror direction.
 class Metal : public Material {
 public:
     float roughness;
 
     Metal(const Shader &s, const Color &a, float roughness)
-        : roughness(roughness)
+        : roughness(clamp01(roughness))
     {
         shader = s;
         albedo = a;
     }
 
     virtual bool scatter(
-        const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out
+        const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out,
+        Sampler &sampler
+    ) const;
+
+    virtual bool specular() const {
+        return roughness <= 0;
+    }
+
+    virtual Color eval(
+        const Ray &r_in, const Hit &hit, const Vec3 &direction
+    ) const;
+
+    virtual float pdf(
+        const Ray &r_in, const Hit &hit, const Vec3 &direction
     ) const;
+
+private:
+    // Phong exponent of the lobe
+    inline float exponent() const;
 };
 
 class Dielectric : public Material {
@@ -65,7 +129,8 @@ public:
         : albedo(Color::White), ri(refraction_index) {}
 
     virtual bool scatter(
-        const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out
+        const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out,
+        Sampler &sampler
     ) const;
 };
 
@@ -79,13 +144,23 @@ public:
         return emit;
     }
 
+    virtual bool emissive() const {
+        return true;
+    }
+
     virtual bool scatter(
-        const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out
+        const Ray &r_in, const Hit &hit, Color &attenuation, Ray &r_out,
+        Sampler &sampler
     ) const {
         return false;
     }
 };
 
+inline float Metal::exponent() const {
+    // Matches the width of a Beckmann lobe of the same roughness
+    return 2.0f / (roughness*roughness) - 2.0f;
+}
+
 } // ne
 
 #endif // NE_MATERIAL_H
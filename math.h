@@ -2,6 +2,7 @@
 #define NE_MATH_H
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 
@@ -31,9 +32,55 @@ inline float radians(float degrees) {
     return degrees * PI / 180.0f;
 }
 
+// PCG32 random number generator (O'Neill 2014). Each seq selects an
+// independent stream for the same seed.
+struct Rng {
+    uint64_t state = 0x853c49e6748fea9bULL;
+    uint64_t inc = 0xda3e39cb94b95bdbULL;
+
+    inline void seed(uint64_t seed, uint64_t seq);
+    inline uint32_t next();
+
+    // Random number in range [0,1)
+    inline float nextf();
+};
+
+inline void Rng::seed(uint64_t seed, uint64_t seq) {
+    state = 0;
+    inc = (seq << 1) | 1;
+    next();
+    state += seed;
+    next();
+}
+
+inline uint32_t Rng::next() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+    uint32_t rot = uint32_t(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+inline float Rng::nextf() {
+    // 24 bits fit exactly in the mantissa so the result is never 1
+    return (next() >> 8) * (1.0f / 16777216.0f);
+}
+
+// Generator used by randomf, each thread has its own so there is no
+// shared state or lock between render threads.
+inline Rng &thread_rng() {
+    static thread_local Rng rng;
+    return rng;
+}
+
+// Restarts the random numbers of the calling thread at stream seq of seed
+inline void seed_random(uint64_t seed, uint64_t seq) {
+    thread_rng().seed(seed, seq);
+}
+
 // Random number in range [0,1)
 inline float randomf() {
-    return rand() / (static_cast<float>(RAND_MAX) + 1.0f);
+    return thread_rng().nextf();
 }
 
 inline float randomf(float min, float max) {
@@ -17,6 +17,23 @@ struct Ray
     inline Vec3 at(float dist) const;
 };
 
+// Group of rays traced together, see Entity::intersect_packet. Each lane
+// has its own search range which shrinks as closer hits are found.
+struct RayPacket
+{
+    static const int Size = 4;
+
+    Ray rays[Size];
+    float min_dist[Size];
+    float max_dist[Size];
+
+    inline Range range(int lane) const;
+};
+
+inline Range RayPacket::range(int lane) const {
+    return Range(min_dist[lane], max_dist[lane]);
+}
+
 inline Vec3 Ray::at(float dist) const {
     return origin + direction*dist;
 }
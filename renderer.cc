@@ -7,31 +7,95 @@
 #include "io.h"
 
 #include <cstdio>
+#include <cstdint>
+#include <algorithm>
 #include <vector>
 #include <thread>
 #include <cmath>
 
 namespace ne {
 
+// Weight of a sample taken with pdf f against another strategy with pdf
+// g for multiple importance sampling (Veach 1997)
+inline float power_heuristic(float f, float g) {
+    return f*f / (f*f + g*g);
+}
+
+// Ends a path with a probability that grows as its throughput drops.
+// The throughput of paths that continue is divided by the probability
+// they survive, so the estimate stays unbiased. Returns false when the
+// path ends.
+inline bool russian_roulette(Color &throughput, Sampler &sampler) {
+    float q = fminf(fmaxf(throughput.r, fmaxf(throughput.g, throughput.b)), 0.95f);
+    if (sampler.get1d() >= q) {
+        return false;
+    }
+    throughput = throughput * (1.0f / q);
+    return true;
+}
+
+// Traces count samples of pixel (x, py) from sample index first and
+// writes the color of each to colors
+static void trace_samples(const Camera &camera,
+                          const Entity *entity,
+                          const RenderJob &job,
+                          int width,
+                          int x,
+                          int py,
+                          int first,
+                          int count,
+                          Sampler &sampler,
+                          Color *colors)
+{
+    auto bg = Color::Black;
+    float h = float(job.chunk.tex_height) - 1;
+    int n = 0;
+
+    // Samples of a pixel are nearly coherent, trace them in packets
+    for (; job.packets && n + RayPacket::Size <= count; n += RayPacket::Size) {
+        RayPacket packet;
+        for (int i = 0; i < RayPacket::Size; ++i) {
+            sampler.start_sample(x, py, first + n + i);
+            Vec3 jitter = sampler.get2d();
+            float u = (float(x) + jitter.x) / float(width - 1);
+            float v = (float(py) + jitter.y) / h;
+            packet.rays[i] = camera.ray_from_view(u, v, sampler.get2d());
+            packet.min_dist[i] = MinDist;
+            packet.max_dist[i] = Infinity;
+        }
+        // Lanes continue from the first sample of the packet
+        sampler.start_sample(x, py, first + n, sampler.dimension);
+        Renderer::trace_packet(packet, bg, entity, job.lights, job.max_depth,
+                               sampler, &colors[n]);
+    }
+    for (; n < count; ++n) {
+        sampler.start_sample(x, py, first + n);
+        Vec3 jitter = sampler.get2d();
+        float u = (float(x) + jitter.x) / float(width - 1);
+        float v = (float(py) + jitter.y) / h;
+        auto ray = camera.ray_from_view(u, v, sampler.get2d());
+        colors[n] = Renderer::trace_ray(ray, bg, entity, job.lights,
+                                        job.max_depth, sampler, 0.0f);
+    }
+}
+
 void render_job(const Camera &camera,
                 const Entity *entity,
                 const Texture *render_tex,
                 const RenderJob &job)
 {
-    srand(job.seed);
     int width = render_tex->width();
     int height = render_tex->height();
-    auto bg = Color::Black;
+    auto sampler = Sampler::create(job.sampler, job.seed);
+    std::vector<Color> samples(job.aa_samples);
 
     for (int y = 0; y < height; ++y) {
         for (int x = 0; x < width; ++x) {
+            trace_samples(camera, entity, job, width, x, y + job.chunk.offset_y,
+                          job.sample_offset, job.aa_samples, *sampler, samples.data());
             auto color = Color::Black;
-            for (int n = 0; n < job.aa_samples; ++n) {
-                float h = float(job.chunk.tex_height) - 1;
-                float u = (float(x) + randomf()) / float(width - 1);
-                float v = (float(y + job.chunk.offset_y) + randomf()) / h;
-                auto ray = camera.ray_from_view(u, v);
-                color = color + Renderer::trace_ray(ray, bg, entity, job.max_depth);
+            for (const auto &sample : samples) {
+                color = color + sample;
             }
             color = Color::gamma2(color, 1.0f / job.aa_samples);
             render_tex->write_pixel(x, y, color);
@@ -45,6 +109,64 @@ void render_job(const Camera &camera,
     }
 }
 
+// Sum of the colors of a pixel's samples, with the running mean and
+// variance of their luminance (Welford 1962)
+struct PixelStats {
+    Color sum;
+    float mean;
+    float m2;
+    int count;
+
+    inline void add(const Color &c) {
+        float y = 0.2126f*c.r + 0.7152f*c.g + 0.0722f*c.b;
+        ++count;
+        float d = y - mean;
+        mean += d / count;
+        m2 += d * (y - mean);
+        sum = sum + c;
+    }
+
+    // Standard error of the mean luminance after gamma correction, which
+    // scales it by the derivative of sqrt. Dark pixels are clamped so
+    // they do not need many more samples than the eye can tell.
+    inline float error() const {
+        if (count < 2) {
+            return Infinity;
+        }
+        float variance = m2 / (count - 1);
+        return sqrtf(variance / count) / (2.0f * sqrtf(fmaxf(mean, 0.001f)));
+    }
+};
+
+// Samples first to first + count of a pixel, traced in one adaptive pass
+struct PixelBatch {
+    int pixel;
+    int first;
+    int count;
+};
+
+static void render_adaptive_pass(const Camera &camera,
+                                 const Entity *entity,
+                                 int width,
+                                 const RenderJob &job,
+                                 const PixelBatch *batches,
+                                 size_t count,
+                                 PixelStats *stats)
+{
+    auto sampler = Sampler::create(job.sampler, job.seed);
+    std::vector<Color> samples;
+    for (size_t i = 0; i < count; ++i) {
+        const auto &batch = batches[i];
+        samples.resize(batch.count);
+        trace_samples(camera, entity, job, width, batch.pixel % width,
+                      batch.pixel / width + job.chunk.offset_y,
+                      batch.first, batch.count, *sampler, samples.data());
+        for (const auto &sample : samples) {
+            stats[batch.pixel].add(sample);
+        }
+    }
+}
+
 void tex_blend(const Texture *dst, const std::vector<Texture *> &src) {
     float n = 1 + src.size();
     for (int y = 0; y < dst->height(); ++y) {
@@ -64,10 +186,17 @@ void Renderer::render_chunk(const Camera &camera,
                             const Texture *render_tex,
                             const RenderChunk &chunk) const
 {
-    int s = random_int(0, 0xffff);
+    if (adaptive.enabled) {
+        render_adaptive(camera, entity, render_tex, chunk);
+        return;
+    }
+
+    // Jobs share the seed and split the sample indices of each pixel
+    int s = int(thread_rng().next() >> 1);
     int n = std::min(threads, aa_samples);
     if (n <= 1) {
-        RenderJob job{0, aa_samples, max_depth, s, chunk};
+        RenderJob job{0, aa_samples, 0, max_depth, s, chunk, packets,
+                      sampler, lights};
         render_job(camera, entity, render_tex, job);
         return;
     }
@@ -80,14 +209,16 @@ void Renderer::render_chunk(const Camera &camera,
 
     for (int i = 1; i < n; ++i) {
         auto tex = new Texture(render_tex->width(), render_tex->height());
-        int t_s = random_int(0, 0xffff);
+        int offset = chunk_samples + rem + (i - 1) * chunk_samples;
 
-        RenderJob job{i, chunk_samples, max_depth, t_s, chunk};
+        RenderJob job{i, chunk_samples, offset, max_depth, s, chunk, packets,
+                      sampler, lights};
         workers.push_back(std::thread(render_job, camera, entity, tex, job));
         results.push_back(tex);
     }
     // Render on main thread
-    RenderJob job{0, chunk_samples + rem, max_depth, s, chunk};
+    RenderJob job{0, chunk_samples + rem, 0, max_depth, s, chunk, packets,
+                  sampler, lights};
     render_job(camera, entity, render_tex, job);
 
     // Wait for other threads to complete
@@ -102,6 +233,122 @@ void Renderer::render_chunk(const Camera &camera,
     }
 }
 
+void Renderer::render_adaptive(const Camera &camera,
+                               const Entity *entity,
+                               const Texture *render_tex,
+                               const RenderChunk &chunk) const
+{
+    int width = render_tex->width();
+    int height = render_tex->height();
+    int pixels = width * height;
+
+    // Jobs share the seed and split the pixels of each pass
+    int s = int(thread_rng().next() >> 1);
+    RenderJob job{0, aa_samples, 0, max_depth, s, chunk, packets,
+                  sampler, lights};
+
+    int max_samples = adaptive.max_samples > 0 ? adaptive.max_samples : 8 * aa_samples;
+    int min_samples = std::max(2, std::min(adaptive.min_samples,
+                                           std::min(aa_samples, max_samples)));
+    int64_t budget = int64_t(aa_samples) * pixels;
+    int64_t spent = 0;
+
+    std::vector<PixelStats> stats(pixels, PixelStats{});
+    std::vector<PixelBatch> batches;
+    for (int p = 0; p < pixels; ++p) {
+        batches.push_back(PixelBatch{p, 0, min_samples});
+    }
+    std::vector<float> pixel_errors(pixels);
+    std::vector<float> errors(pixels);
+    std::vector<int> noisy;
+
+    while (!batches.empty()) {
+        int64_t pass_samples = 0;
+        for (const auto &batch : batches) {
+            pass_samples += batch.count;
+        }
+
+        // Threads take ranges of batches with about as many samples each
+        int n = std::max(1, threads);
+        std::vector<size_t> ranges(n + 1, batches.size());
+        ranges[0] = 0;
+        int64_t sum = 0;
+        for (size_t i = 0, t = 1; i < batches.size() && t < size_t(n); ++i) {
+            sum += batches[i].count;
+            if (sum * n >= pass_samples * int64_t(t)) {
+                ranges[t++] = i + 1;
+            }
+        }
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < n; ++t) {
+            RenderJob thread_job = job;
+            thread_job.tid = t;
+            workers.push_back(std::thread(render_adaptive_pass, camera, entity, width,
+                                          thread_job, batches.data() + ranges[t],
+                                          ranges[t + 1] - ranges[t], stats.data()));
+        }
+        render_adaptive_pass(camera, entity, width, job, batches.data(),
+                             ranges[1], stats.data());
+        for (auto &w : workers) {
+            w.join();
+        }
+        spent += pass_samples;
+
+        float progress = (chunk.offset_y + height * float(spent) / budget)
+                       / chunk.tex_height * 100.0f;
+        printf("\rrender: %d%%", int(progress));
+        fflush(stdout);
+
+        // Pixels keep sampling while they or a neighbour are noisy. Pixels
+        // that have not yet found a rare bright path look converged on
+        // their own, stopping them would darken the image.
+        for (int p = 0; p < pixels; ++p) {
+            pixel_errors[p] = stats[p].error();
+        }
+        noisy.clear();
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                int p = y * width + x;
+                errors[p] = 0;
+                for (int ny = std::max(0, y - 1); ny <= std::min(height - 1, y + 1); ++ny) {
+                    for (int nx = std::max(0, x - 1); nx <= std::min(width - 1, x + 1); ++nx) {
+                        errors[p] = fmaxf(errors[p], pixel_errors[ny * width + nx]);
+                    }
+                }
+                if (stats[p].count < max_samples && errors[p] > adaptive.max_error) {
+                    noisy.push_back(p);
+                }
+            }
+        }
+
+        // The rest of the budget goes to the noisiest pixels first, each
+        // pass at most doubles the samples of a pixel
+        std::sort(noisy.begin(), noisy.end(),
+                  [&](int a, int b) { return errors[a] > errors[b]; });
+
+        batches.clear();
+        int64_t remaining = budget - spent;
+        for (int p : noisy) {
+            if (remaining <= 0) {
+                break;
+            }
+            int count = std::min(stats[p].count, max_samples - stats[p].count);
+            count = int(std::min(int64_t(count), remaining));
+            batches.push_back(PixelBatch{p, stats[p].count, count});
+            remaining -= count;
+        }
+        // Back in image order for coherent rays
+        std::sort(batches.begin(), batches.end(),
+                  [](const PixelBatch &a, const PixelBatch &b) { return a.pixel < b.pixel; });
+    }
+
+    for (int p = 0; p < pixels; ++p) {
+        auto color = Color::gamma2(stats[p].sum, 1.0f / stats[p].count);
+        render_tex->write_pixel(p % width, p / width, color);
+    }
+}
+
 void Renderer::render(const Camera &camera,
                       const Entity *entity,
                       const Texture *render_tex) const
@@ -114,9 +361,18 @@ void Renderer::render_progressive(const Camera &camera,
                                   const Entity *entity,
                                   const Texture *render_tex) const
 {
+    RenderChunk chunk{0, 0, render_tex->width(), render_tex->height()};
+    if (adaptive.enabled) {
+        // The sample budget is shared by the whole image, rendering it in
+        // bands would split it per band
+        render_chunk(camera, entity, render_tex, chunk);
+        write_bmp("tex.bmp", render_tex);
+        printf("\rrender: 100%%\n");
+        return;
+    }
+
     int chunks = render_tex->height() / chunk_size;
     int rem = render_tex->height() % chunk_size;
-    RenderChunk chunk{0, 0, render_tex->width(), render_tex->height()};
 
     auto buffer = new Texture(render_tex->width(), chunk_size + rem);
     render_chunk(camera, entity, buffer, chunk);
@@ -139,7 +395,10 @@ void Renderer::render_progressive(const Camera &camera,
 Color Renderer::trace_ray(const Ray &r_in,
                           const Color &bg,
                           const Entity *entity,
-                          int depth)
+                          const Entity *lights,
+                          int depth,
+                          Sampler &sampler,
+                          float scatter_pdf)
 {
     if (depth <= 0) {
         return Color::Black;
@@ -152,16 +411,142 @@ Color Renderer::trace_ray(const Ray &r_in,
         //float t = 0.5f*(direction.y + 1.0f);
         //return Color::lerp(Color::White, Color(0.5f, 0.7f, 1.0f), t);
     }
+    return shade(r_in, hit, bg, entity, lights, depth, sampler, scatter_pdf);
+}
+
+Color Renderer::trace_packet(RayPacket &packet,
+                             const Color &bg,
+                             const Entity *entity,
+                             const Entity *lights,
+                             int depth,
+                             Sampler &sampler,
+                             Color *lanes)
+{
+    if (depth <= 0) {
+        for (int i = 0; lanes && i < RayPacket::Size; ++i) {
+            lanes[i] = Color::Black;
+        }
+        return Color::Black;
+    }
+    Hit hits[RayPacket::Size];
+    int mask = (1 << RayPacket::Size) - 1;
+    int hit_mask = entity->intersect_packet(packet, mask, hits);
+
+    int x = sampler.x;
+    int y = sampler.y;
+    int index = sampler.index;
+    int dimension = sampler.dimension;
+
+    auto color = Color::Black;
+    for (int i = 0; i < RayPacket::Size; ++i) {
+        Color lane = bg;
+        if (hit_mask & (1 << i)) {
+            sampler.start_sample(x, y, index + i, dimension);
+            lane = shade(packet.rays[i], hits[i], bg, entity, lights,
+                         depth, sampler, 0.0f);
+        }
+        if (lanes) {
+            lanes[i] = lane;
+        }
+        color = color + lane;
+    }
+    return color;
+}
+
+Color Renderer::shade(const Ray &r_in,
+                      const Hit &first_hit,
+                      const Color &bg,
+                      const Entity *entity,
+                      const Entity *lights,
+                      int depth,
+                      Sampler &sampler,
+                      float scatter_pdf)
+{
+    Color color = Color::Black;
+    Color throughput = Color::White;
+    Ray ray = r_in;
+    Hit hit = first_hit;
+
+    for (int bounce = 0; ; ++bounce) {
+        color = color + throughput * emitted(ray, hit, lights, scatter_pdf);
+
+        // Next event estimation
+        bool sample_lights = lights && !hit.material->specular();
+        if (sample_lights) {
+            color = color + throughput * sample_light(ray, hit, entity, lights, sampler);
+        }
+        if (bounce + 1 >= depth) {
+            break;
+        }
+
+        Ray r_out;
+        Color attenuation;
+        if (!hit.material->scatter(ray, hit, attenuation, r_out, sampler)) {
+            break;
+        }
+        scatter_pdf = sample_lights ? hit.material->pdf(
+            ray, hit, r_out.direction.normalized()) : 0.0f;
+        throughput = throughput * attenuation;
+        if (bounce + 1 >= RouletteDepth && !russian_roulette(throughput, sampler)) {
+            break;
+        }
+
+        ray = r_out;
+        if (!entity->ray_intersect(ray, Range{MinDist, Infinity}, hit)) {
+            color = color + throughput * bg;
+            break;
+        }
+    }
+    return color;
+}
 
-    Ray r_out;
-    Color attenuation;
-    Color emitted = hit.material->emitted(hit.uv.x, hit.uv.y, hit.position);
+Color Renderer::sample_light(const Ray &r_in,
+                             const Hit &hit,
+                             const Entity *entity,
+                             const Entity *lights,
+                             Sampler &sampler)
+{
+    Vec3 direction = lights->random(hit.position, sampler.get2d()).normalized();
+    float light_pdf = lights->pdf_value(hit.position, direction);
+    if (light_pdf <= 0) {
+        return Color::Black;
+    }
+    Color f = hit.material->eval(r_in, hit, direction);
+    if (f == Color::Black) {
+        return Color::Black;
+    }
 
-    if (!hit.material->scatter(r_in, hit, attenuation, r_out)) {
-        return emitted;
+    Ray shadow(hit.position, direction);
+    Hit light;
+    if (!lights->ray_intersect(shadow, Range{MinDist, Infinity}, light)) {
+        return Color::Black;
     }
-    return emitted + attenuation * trace_ray(r_out, bg, entity, depth - 1);
+    if (entity->occluded(shadow, Range{MinDist, light.dist - MinDist})) {
+        return Color::Black;
+    }
+    Color le = light.material->emitted(light.uv.x, light.uv.y, light.position);
+    float weight = power_heuristic(light_pdf, hit.material->pdf(r_in, hit, direction));
+    return f * le * (weight / light_pdf);
+}
 
+Color Renderer::emitted(const Ray &r_in,
+                        const Hit &hit,
+                        const Entity *lights,
+                        float scatter_pdf)
+{
+    Color le = hit.material->emitted(hit.uv.x, hit.uv.y, hit.position);
+    if (scatter_pdf <= 0 || le == Color::Black) {
+        return le;
+    }
+    // Emitters that are not in the lights are never sampled and keep
+    // their full weight. The hit is on a light if the ray hits the
+    // lights at the same distance.
+    float eps = MinDist + hit.dist * 1e-4f;
+    if (!lights->occluded(r_in, Range{hit.dist - eps, hit.dist + eps})) {
+        return le;
+    }
+    float light_pdf = lights->pdf_value(r_in.origin, r_in.direction);
+    return le * power_heuristic(scatter_pdf, light_pdf);
 }
 
 } // ne
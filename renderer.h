@@ -7,9 +7,35 @@
 #include "ray.h"
 #include "entity.h"
 #include "camera.h"
+#include "sampler.h"
 
 namespace ne {
 
+// Bounces before a path can end by Russian roulette
+const int RouletteDepth = 3;
+
+// Adaptive sampling spends the same aa_samples per pixel on average, but
+// stops sampling pixels once their error is small and gives the rest of
+// the budget to the noisiest pixels. Pixels are sampled in passes that
+// each at most double their samples. The budget is shared by every pixel
+// of the image, render_progressive renders adaptive images in one piece
+// rather than in bands of chunk_size rows.
+struct AdaptiveOptions {
+    bool enabled = false;
+
+    // Samples every pixel gets before its error is estimated. Pixels
+    // that rarely see a bright light can look converged when this is low.
+    int min_samples = 32;
+
+    // Most samples a pixel gets, 0 is 8 times aa_samples
+    int max_samples = 0;
+
+    // Pixels stop once the standard error of their luminance, measured
+    // after gamma correction, is below this in them and their neighbours.
+    // The default is about two steps of an 8 bit image.
+    float max_error = 0.008f;
+};
+
 struct RenderChunk {
     int offset_x;
     int offset_y;
@@ -20,28 +46,59 @@ struct RenderChunk {
 struct RenderJob {
     int tid;
     int aa_samples;
+
+    // Index of the first sample, jobs that split the samples of a pixel
+    // take consecutive ranges of the same sequence
+    int sample_offset;
+
     int max_depth;
     int seed;
     RenderChunk chunk;
+    bool packets;
+    SamplerType sampler;
+    const Entity *lights;
 };
 
 class Renderer {
 public:
     int aa_samples;
+
+    // Most rays of a path, paths usually end sooner by Russian roulette
+    // after RouletteDepth bounces
     int max_depth;
+
     int threads;
     int chunk_size;
 
+    // Trace camera rays of a pixel in packets of RayPacket::Size
+    bool packets;
+
+    // Per pixel sample counts, aa_samples is the average when enabled
+    AdaptiveOptions adaptive;
+
+    // Sequence the random numbers of each sample come from
+    SamplerType sampler;
+
+    // Lights sampled at every hit that is not specular, made with
+    // collect_lights. Lights are only found by chance when null.
+    const Entity *lights;
+
     Renderer(int aa_samples, int max_depth, int threads, int chunk_size)
         : aa_samples(aa_samples),
           max_depth(max_depth),
           threads(threads),
-          chunk_size(chunk_size) {}
+          chunk_size(chunk_size),
+          packets(true),
+          sampler(SamplerType::Sobol),
+          lights(nullptr) {}
 
     Renderer(int aa_samples, int max_depth, int threads)
         : aa_samples(aa_samples),
           max_depth(max_depth),
-          threads(threads) { chunk_size = 64; }
+          threads(threads),
+          packets(true),
+          sampler(SamplerType::Sobol),
+          lights(nullptr) { chunk_size = 64; }
 
     void render(const Camera &camera,
                 const Entity *entity,
@@ -51,16 +108,69 @@ public:
                             const Entity *entity,
                             const Texture *render_tex) const;
 
+    // scatter_pdf is the pdf of the ray's direction when it leaves a hit
+    // that sampled the lights, 0 otherwise. Lights hit by such a ray are
+    // weighted against light sampling with multiple importance sampling.
     static Color trace_ray(const Ray &ray,
                            const Color &bg,
                            const Entity *entity,
-                           int depth);
+                           const Entity *lights,
+                           int depth,
+                           Sampler &sampler,
+                           float scatter_pdf);
+
+    // Traces the lanes of a packet, returns the sum of their colors.
+    // Only the first hit is found for all lanes at once, the rest of
+    // each path is followed one lane at a time by shade. Lane i
+    // continues sample sampler.index + i of the sampler's pixel from
+    // sampler.dimension.
+    // The color of each lane is also written to lanes if not null.
+    static Color trace_packet(RayPacket &packet,
+                              const Color &bg,
+                              const Entity *entity,
+                              const Entity *lights,
+                              int depth,
+                              Sampler &sampler,
+                              Color *lanes = nullptr);
+
+    // Color of the light leaving a hit back along r_in. Follows the
+    // path from the hit with an explicit throughput until it leaves the
+    // scene, is absorbed, has depth rays or ends by Russian roulette.
+    static Color shade(const Ray &r_in,
+                       const Hit &first_hit,
+                       const Color &bg,
+                       const Entity *entity,
+                       const Entity *lights,
+                       int depth,
+                       Sampler &sampler,
+                       float scatter_pdf);
+
+    // Light arriving at a hit directly from a random point on the lights,
+    // scattered back along r_in and weighted against scattering
+    static Color sample_light(const Ray &r_in,
+                              const Hit &hit,
+                              const Entity *entity,
+                              const Entity *lights,
+                              Sampler &sampler);
+
+    // Emitted light of a hit, weighted against light sampling when the
+    // ray left a hit that sampled the lights and the hit is on one of the
+    // lights, see trace_ray
+    static Color emitted(const Ray &r_in,
+                         const Hit &hit,
+                         const Entity *lights,
+                         float scatter_pdf);
 
 private:
     void render_chunk(const Camera &camera,
                       const Entity *entity,
                       const Texture *render_tex,
                       const RenderChunk &chunk) const;
+
+    void render_adaptive(const Camera &camera,
+                         const Entity *entity,
+                         const Texture *render_tex,
+                         const RenderChunk &chunk) const;
 };
 
 }
@@ -0,0 +1,308 @@
+#include "sampler.h"
+#include "math.h"
+
+#include <cmath>
+#include <vector>
+
+namespace ne {
+
+// Largest float below 1
+const float OneMinusEpsilon = 0x1.fffffep-1f;
+
+std::unique_ptr<Sampler> Sampler::create(SamplerType type, uint32_t seed) {
+    switch (type) {
+    case SamplerType::Halton:
+        return std::unique_ptr<Sampler>(new HaltonSampler(seed));
+    case SamplerType::Sobol:
+        return std::unique_ptr<Sampler>(new SobolSampler(seed));
+    case SamplerType::BlueNoise:
+        return std::unique_ptr<Sampler>(new BlueNoiseSampler(seed));
+    default:
+        return std::unique_ptr<Sampler>(new IndependentSampler(seed));
+    }
+}
+
+Vec3 sample_disk(const Vec3 &u) {
+    float ox = 2.0f*u.x - 1.0f;
+    float oy = 2.0f*u.y - 1.0f;
+    if (ox == 0 && oy == 0) {
+        return Vec3();
+    }
+    float r, theta;
+    if (fabsf(ox) > fabsf(oy)) {
+        r = ox;
+        theta = 0.25f*PI * (oy / ox);
+    } else {
+        r = oy;
+        theta = 0.5f*PI - 0.25f*PI * (ox / oy);
+    }
+    return Vec3(r*cosf(theta), r*sinf(theta), 0);
+}
+
+inline float bits_to_float(uint32_t bits) {
+    return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+// Adds a shift to a sample in [0,1) and wraps it around
+inline float wrap_shift(float u, float shift) {
+    float v = u + shift;
+    return fminf(v >= 1.0f ? v - 1.0f : v, OneMinusEpsilon);
+}
+
+float IndependentSampler::get1d() {
+    return to_float(hash(dimension++));
+}
+
+Vec3 IndependentSampler::get2d() {
+    uint64_t h = hash(dimension);
+    dimension += 2;
+    return Vec3(to_float(h), to_float(mix_bits(h)), 0);
+}
+
+// Bases of the Halton dimensions, later dimensions are independent
+const int HaltonDimensions = 32;
+const int primes[HaltonDimensions] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+};
+
+inline float radical_inverse(int base, uint32_t i) {
+    double inv_base = 1.0 / base;
+    double f = inv_base;
+    double r = 0;
+    while (i) {
+        r += (i % base) * f;
+        i /= base;
+        f *= inv_base;
+    }
+    return fminf(float(r), OneMinusEpsilon);
+}
+
+float HaltonSampler::get1d() {
+    int dim = dimension++;
+    if (dim >= HaltonDimensions) {
+        return to_float(hash(dim));
+    }
+    // Cranley-Patterson rotation so pixels do not share the same points
+    float shift = to_float(pixel_hash(dim));
+    return wrap_shift(radical_inverse(primes[dim], uint32_t(index)), shift);
+}
+
+Vec3 HaltonSampler::get2d() {
+    float u = get1d();
+    float v = get1d();
+    return Vec3(u, v, 0);
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+// Hash where each bit only depends on the bits below it
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return x;
+}
+
+// Owen scrambling of the bits of a number in [0,1), every digit is
+// permuted based on the digits before it
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x = laine_karras_permutation(x, seed);
+    return reverse_bits(x);
+}
+
+// First two dimensions of the Sobol sequence with Owen scrambling.
+// Scrambling works on the reversed bits, the first dimension is the
+// reversed index and the second is tabulated reversed, so only the
+// result has to be reversed back.
+inline uint32_t scrambled_sobol0(uint32_t i, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(i, seed));
+}
+
+// Reversed second dimension from its direction numbers, a byte of the
+// index at a time. Shuffled indices use all 32 bits.
+struct Sobol1Table {
+    uint32_t bytes[4][256];
+
+    Sobol1Table() {
+        uint32_t v[32];
+        v[0] = 1u << 31;
+        for (int k = 1; k < 32; ++k) {
+            v[k] = v[k - 1] ^ (v[k - 1] >> 1);
+        }
+        for (int k = 0; k < 4; ++k) {
+            for (int b = 0; b < 256; ++b) {
+                uint32_t r = 0;
+                for (int j = 0; j < 8; ++j) {
+                    if (b & (1 << j)) r ^= v[8*k + j];
+                }
+                bytes[k][b] = reverse_bits(r);
+            }
+        }
+    }
+};
+
+const Sobol1Table sobol1_table;
+
+inline uint32_t scrambled_sobol1(uint32_t i, uint32_t seed) {
+    uint32_t r = sobol1_table.bytes[0][i & 0xff]
+               ^ sobol1_table.bytes[1][(i >> 8) & 0xff]
+               ^ sobol1_table.bytes[2][(i >> 16) & 0xff]
+               ^ sobol1_table.bytes[3][i >> 24];
+    return reverse_bits(laine_karras_permutation(r, seed));
+}
+
+// Point at index of a shuffled and scrambled 2D Sobol sequence
+static Vec3 sobol2d(uint32_t index, uint64_t h) {
+    uint32_t i = owen_scramble(index, uint32_t(h));
+    uint64_t h2 = mix_bits(h);
+    return Vec3(bits_to_float(scrambled_sobol0(i, uint32_t(h >> 32))),
+                bits_to_float(scrambled_sobol1(i, uint32_t(h2))),
+                0);
+}
+
+float SobolSampler::get1d() {
+    uint64_t h = pixel_hash(dimension++);
+    uint32_t i = owen_scramble(uint32_t(index), uint32_t(h));
+    return bits_to_float(scrambled_sobol0(i, uint32_t(h >> 32)));
+}
+
+Vec3 SobolSampler::get2d() {
+    uint64_t h = pixel_hash(dimension);
+    dimension += 2;
+    return sobol2d(uint32_t(index), h);
+}
+
+const int MaskSize = 64;
+
+// Blue noise threshold mask made with the void and cluster method
+// (Ulichney 1993). Values are in (0,1) and tile the plane.
+static std::vector<float> make_blue_noise_mask() {
+    const int n = MaskSize * MaskSize;
+    const int radius = 5;
+    const float sigma = 1.5f;
+
+    float kernel[2*radius + 1][2*radius + 1];
+    for (int dy = -radius; dy <= radius; ++dy) {
+        for (int dx = -radius; dx <= radius; ++dx) {
+            kernel[dy + radius][dx + radius] =
+                expf(-(dx*dx + dy*dy) / (2.0f*sigma*sigma));
+        }
+    }
+
+    std::vector<char> pattern(n, 0);
+    std::vector<float> energy(n, 0.0f);
+    auto splat = [&](std::vector<float> &e, int p, float sign) {
+        int px = p % MaskSize;
+        int py = p / MaskSize;
+        for (int dy = -radius; dy <= radius; ++dy) {
+            for (int dx = -radius; dx <= radius; ++dx) {
+                int q = ((py + dy) & (MaskSize - 1)) * MaskSize
+                      + ((px + dx) & (MaskSize - 1));
+                e[q] += sign * kernel[dy + radius][dx + radius];
+            }
+        }
+    };
+    // Densest one, or emptiest zero
+    auto find = [&](const std::vector<char> &pat,
+                    const std::vector<float> &e, char value) {
+        int best = -1;
+        for (int p = 0; p < n; ++p) {
+            if (pat[p] != value) continue;
+            if (best < 0 || (value ? e[p] > e[best] : e[p] < e[best])) {
+                best = p;
+            }
+        }
+        return best;
+    };
+
+    // Initial pattern of random points, relaxed by moving the point in
+    // the tightest cluster to the largest void until they are the same
+    Rng rng;
+    rng.seed(MaskSize, 0);
+    int ones = 0;
+    while (ones < n / 10) {
+        int p = rng.next() % n;
+        if (!pattern[p]) {
+            pattern[p] = 1;
+            splat(energy, p, 1.0f);
+            ++ones;
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        int cluster = find(pattern, energy, 1);
+        pattern[cluster] = 0;
+        splat(energy, cluster, -1.0f);
+        int void_ = find(pattern, energy, 0);
+        pattern[void_] = 1;
+        splat(energy, void_, 1.0f);
+        if (void_ == cluster) break;
+    }
+
+    std::vector<int> rank(n);
+
+    // Points of the initial pattern are ranked by removing clusters
+    std::vector<char> pat = pattern;
+    std::vector<float> e = energy;
+    for (int r = ones - 1; r >= 0; --r) {
+        int cluster = find(pat, e, 1);
+        pat[cluster] = 0;
+        splat(e, cluster, -1.0f);
+        rank[cluster] = r;
+    }
+    // The rest by filling voids
+    for (int r = ones; r < n; ++r) {
+        int void_ = find(pattern, energy, 0);
+        pattern[void_] = 1;
+        splat(energy, void_, 1.0f);
+        rank[void_] = r;
+    }
+
+    std::vector<float> mask(n);
+    for (int p = 0; p < n; ++p) {
+        mask[p] = (rank[p] + 0.5f) / n;
+    }
+    return mask;
+}
+
+BlueNoiseSampler::BlueNoiseSampler(uint32_t seed) : Sampler(seed) {
+    static const std::vector<float> blue_noise = make_blue_noise_mask();
+    mask = blue_noise.data();
+}
+
+// Reads the mask at the pixel, offset by h for each dimension
+inline float mask_value(const float *mask, int x, int y, uint64_t h) {
+    int ox = int(h & (MaskSize - 1));
+    int oy = int((h >> 8) & (MaskSize - 1));
+    return mask[((y + oy) & (MaskSize - 1)) * MaskSize + ((x + ox) & (MaskSize - 1))];
+}
+
+float BlueNoiseSampler::get1d() {
+    // Same points in every pixel
+    uint64_t h = mix_bits(uint64_t(seed) << 32 | uint32_t(dimension++));
+    uint32_t i = owen_scramble(uint32_t(index), uint32_t(h));
+    float u = bits_to_float(scrambled_sobol0(i, uint32_t(h >> 32)));
+    return wrap_shift(u, mask_value(mask, x, y, mix_bits(h)));
+}
+
+Vec3 BlueNoiseSampler::get2d() {
+    uint64_t h = mix_bits(uint64_t(seed) << 32 | uint32_t(dimension));
+    dimension += 2;
+    Vec3 u = sobol2d(uint32_t(index), h);
+    uint64_t h2 = mix_bits(h ^ 1);
+    return Vec3(wrap_shift(u.x, mask_value(mask, x, y, h2)),
+                wrap_shift(u.y, mask_value(mask, x, y, h2 >> 16)),
+                0);
+}
+
+} // ne
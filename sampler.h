@@ -0,0 +1,155 @@
+#ifndef NE_SAMPLER_H
+#define NE_SAMPLER_H
+
+#include "vec.h"
+#include "math.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace ne {
+
+enum class SamplerType {
+    // Uniform random numbers
+    Independent,
+
+    // Halton sequence, shifted randomly for each pixel
+    Halton,
+
+    // Sobol (0,2) sequence with Owen scrambling and a shuffled index for
+    // every pixel and pair of dimensions (Burley 2020)
+    Sobol,
+
+    // The same scrambled Sobol points in every pixel, shifted by a blue
+    // noise mask so the error between neighbouring pixels is blue noise
+    // (Georgiev and Fajardo 2016)
+    BlueNoise,
+};
+
+// Source of the random numbers of a sample. Each call returns the next
+// dimension of the current sample, the values only depend on the pixel,
+// sample index, dimension and seed. Samples with consecutive indices of
+// the same pixel are well distributed together.
+class Sampler {
+public:
+    int x, y;
+    int index;
+    int dimension;
+
+    Sampler(uint32_t seed)
+        : x(0), y(0), index(0), dimension(0),
+          seed(seed), pixel_key(0), sample_key(0) {}
+    virtual ~Sampler() {}
+
+    static std::unique_ptr<Sampler> create(SamplerType type, uint32_t seed);
+
+    // Starts sample index of pixel (x, y) at the given dimension
+    inline void start_sample(int px, int py, int sample_index, int dim = 0);
+
+    // Next dimension in range [0,1)
+    virtual float get1d() = 0;
+
+    // Next two dimensions in range [0,1), z is 0
+    virtual Vec3 get2d() = 0;
+
+protected:
+    uint32_t seed;
+
+    // Hashes of the seed and pixel, and of those and the sample index
+    uint64_t pixel_key;
+    uint64_t sample_key;
+
+    // Hash of a dimension of the current pixel, and of the current sample
+    inline uint64_t pixel_hash(int dim) const;
+    inline uint64_t hash(int dim) const;
+
+    // Uniform random number from a hash
+    static inline float to_float(uint64_t h);
+};
+
+class IndependentSampler : public Sampler {
+public:
+    IndependentSampler(uint32_t seed) : Sampler(seed) {}
+
+    virtual float get1d();
+    virtual Vec3 get2d();
+};
+
+class HaltonSampler : public Sampler {
+public:
+    HaltonSampler(uint32_t seed) : Sampler(seed) {}
+
+    virtual float get1d();
+    virtual Vec3 get2d();
+};
+
+class SobolSampler : public Sampler {
+public:
+    SobolSampler(uint32_t seed) : Sampler(seed) {}
+
+    virtual float get1d();
+    virtual Vec3 get2d();
+};
+
+class BlueNoiseSampler : public Sampler {
+public:
+    BlueNoiseSampler(uint32_t seed);
+
+    virtual float get1d();
+    virtual Vec3 get2d();
+
+private:
+    const float *mask;
+};
+
+// Maps a sample in [0,1)^2 to a point on the unit disk (Shirley and
+// Chiu 1997), z is 0
+Vec3 sample_disk(const Vec3 &u);
+
+// Maps a sample in [0,1)^2 to a direction on the unit sphere
+inline Vec3 sample_sphere(const Vec3 &u) {
+    float a = 2.0f*PI*u.x;
+    float z = 1.0f - 2.0f*u.y;
+    float r = sqrtf(fmaxf(0.0f, 1.0f - z*z));
+    return Vec3(r*cosf(a), r*sinf(a), z);
+}
+
+// splitmix64 finalizer
+inline uint64_t mix_bits(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+// Weyl sequence increment of splitmix64, dimensions step the key by it
+const uint64_t GoldenGamma = 0x9e3779b97f4a7c15ULL;
+
+inline void Sampler::start_sample(int px, int py, int sample_index, int dim) {
+    if (px != x || py != y || pixel_key == 0) {
+        pixel_key = mix_bits(mix_bits(seed) ^ (uint64_t(uint32_t(px)) << 32 | uint32_t(py)));
+    }
+    x = px;
+    y = py;
+    index = sample_index;
+    dimension = dim;
+    sample_key = mix_bits(pixel_key ^ uint32_t(sample_index));
+}
+
+inline uint64_t Sampler::pixel_hash(int dim) const {
+    return mix_bits(pixel_key + GoldenGamma * uint64_t(dim + 1));
+}
+
+inline uint64_t Sampler::hash(int dim) const {
+    return mix_bits(sample_key + GoldenGamma * uint64_t(dim + 1));
+}
+
+inline float Sampler::to_float(uint64_t h) {
+    return (h >> 40) * (1.0f / 16777216.0f);
+}
+
+} // ne
+
+#endif // NE_SAMPLER_H
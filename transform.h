@@ -0,0 +1,174 @@
+#ifndef NE_TRANSFORM_H
+#define NE_TRANSFORM_H
+
+#include "vec.h"
+#include "aabb.h"
+#include "math.h"
+
+#include <cmath>
+
+namespace ne {
+
+// 3x4 affine transform, the last column is the translation.
+struct Transform {
+    float m[3][4];
+
+    // Identity transform
+    Transform();
+
+    static inline Transform translate(const Vec3 &offset);
+    static inline Transform scale(const Vec3 &s);
+
+    // Rotation around an axis in degrees
+    static inline Transform rotate(const Vec3 &axis, float angle);
+
+    inline Transform inverse() const;
+
+    inline bool is_identity() const;
+
+    inline Vec3 point(const Vec3 &p) const;
+    inline Vec3 vector(const Vec3 &v) const;
+
+    // Transforms a normal by the transpose of this matrix. The transform
+    // must be the inverse of the one applied to the surface.
+    inline Vec3 normal(const Vec3 &n) const;
+
+    // Box enclosing the transformed box
+    inline Aabb box(const Aabb &b) const;
+
+    // Apply t first, then this transform
+    Transform operator*(const Transform &t) const;
+};
+
+inline Transform::Transform() {
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            m[i][j] = i == j ? 1.0f : 0.0f;
+        }
+    }
+}
+
+inline Transform Transform::translate(const Vec3 &offset) {
+    Transform t;
+    t.m[0][3] = offset.x;
+    t.m[1][3] = offset.y;
+    t.m[2][3] = offset.z;
+    return t;
+}
+
+inline Transform Transform::scale(const Vec3 &s) {
+    Transform t;
+    t.m[0][0] = s.x;
+    t.m[1][1] = s.y;
+    t.m[2][2] = s.z;
+    return t;
+}
+
+inline Transform Transform::rotate(const Vec3 &axis, float angle) {
+    Vec3 a = axis.normalized();
+    float s = sinf(radians(angle));
+    float c = cosf(radians(angle));
+    float k = 1.0f - c;
+
+    Transform t;
+    t.m[0][0] = a.x*a.x*k + c;
+    t.m[0][1] = a.x*a.y*k - a.z*s;
+    t.m[0][2] = a.x*a.z*k + a.y*s;
+    t.m[1][0] = a.y*a.x*k + a.z*s;
+    t.m[1][1] = a.y*a.y*k + c;
+    t.m[1][2] = a.y*a.z*k - a.x*s;
+    t.m[2][0] = a.z*a.x*k - a.y*s;
+    t.m[2][1] = a.z*a.y*k + a.x*s;
+    t.m[2][2] = a.z*a.z*k + c;
+    return t;
+}
+
+inline Transform Transform::inverse() const {
+    // Inverse of the 3x3 part from its cofactors
+    float c00 = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+    float c01 = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+    float c02 = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+    float det = m[0][0]*c00 + m[0][1]*c01 + m[0][2]*c02;
+    float inv_det = 1.0f / det;
+
+    Transform t;
+    t.m[0][0] = c00 * inv_det;
+    t.m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * inv_det;
+    t.m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+    t.m[1][0] = c01 * inv_det;
+    t.m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+    t.m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * inv_det;
+    t.m[2][0] = c02 * inv_det;
+    t.m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * inv_det;
+    t.m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+
+    // Translation is the inverse rotation of the negated offset
+    Vec3 offset(m[0][3], m[1][3], m[2][3]);
+    Vec3 inv_offset = -t.vector(offset);
+    t.m[0][3] = inv_offset.x;
+    t.m[1][3] = inv_offset.y;
+    t.m[2][3] = inv_offset.z;
+    return t;
+}
+
+inline bool Transform::is_identity() const {
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            if (m[i][j] != (i == j ? 1.0f : 0.0f)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+inline Vec3 Transform::point(const Vec3 &p) const {
+    return Vec3(m[0][0]*p.x + m[0][1]*p.y + m[0][2]*p.z + m[0][3],
+                m[1][0]*p.x + m[1][1]*p.y + m[1][2]*p.z + m[1][3],
+                m[2][0]*p.x + m[2][1]*p.y + m[2][2]*p.z + m[2][3]);
+}
+
+inline Vec3 Transform::vector(const Vec3 &v) const {
+    return Vec3(m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+                m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+                m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+}
+
+inline Vec3 Transform::normal(const Vec3 &n) const {
+    return Vec3(m[0][0]*n.x + m[1][0]*n.y + m[2][0]*n.z,
+                m[0][1]*n.x + m[1][1]*n.y + m[2][1]*n.z,
+                m[0][2]*n.x + m[1][2]*n.y + m[2][2]*n.z);
+}
+
+inline Aabb Transform::box(const Aabb &b) const {
+    // Each axis of the result is the translation plus the smallest and
+    // largest contribution of every input axis (Arvo 1990).
+    Vec3 min(m[0][3], m[1][3], m[2][3]);
+    Vec3 max = min;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            float e0 = m[i][j] * b.min_bounds[j];
+            float e1 = m[i][j] * b.max_bounds[j];
+            min.a[i] += fminf(e0, e1);
+            max.a[i] += fmaxf(e0, e1);
+        }
+    }
+    return Aabb(min, max);
+}
+
+inline Transform Transform::operator*(const Transform &t) const {
+    Transform r;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            r.m[i][j] = m[i][0]*t.m[0][j]
+                      + m[i][1]*t.m[1][j]
+                      + m[i][2]*t.m[2][j];
+        }
+        r.m[i][3] += m[i][3];
+    }
+    return r;
+}
+
+} // ne
+
+#endif // NE_TRANSFORM_H
@@ -51,6 +51,9 @@ struct Vec3 {
     // Refract a vector on normal
     static inline Vec3 refract(const Vec3 &v, const Vec3 &n, float etai_etat);
 
+    // Two unit vectors perpendicular to the unit vector w and each other
+    static inline void basis(const Vec3 &w, Vec3 &u, Vec3 &v);
+
     // Returns a vector of length 1 with a random direction
     static inline Vec3 random_lambertian();
     static inline Vec3 random_in_unit_sphere();
@@ -124,6 +127,12 @@ inline Vec3 Vec3::refract(const Vec3 &v, const Vec3 &n, float etai_etat) {
     return r_parallel + r_perp;
 }
 
+inline void Vec3::basis(const Vec3 &w, Vec3 &u, Vec3 &v) {
+    Vec3 a = fabsf(w.x) > 0.9f ? Vec3(0, 1, 0) : Vec3(1, 0, 0);
+    v = cross(w, a).normalized();
+    u = cross(w, v);
+}
+
 inline Vec3 Vec3::random_in_unit_sphere() {
     for (;;) {
         Vec3 r{randomf(-1.0f, 1.0f),